@@ -0,0 +1,522 @@
+// Times the interpreter on a set of Lisp workloads, built from the same source
+//
+//     cc -O2 -o bench bench.c -lm
+//     ./bench [--engine tree|vm] [--repeat n] [--json] [workload...]
+//     ./bench --micro [--json] [micro...]
+//
+// Each workload gets a fresh global environment. Its setup forms are run first,
+// then its run forms are timed. The fastest of `--repeat` runs is reported.
+// `--micro` runs the C level microbenchmarks of runtime internals instead.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Every allocation the interpreter makes goes through these, so each workload
+// can report how many it did
+size_t bench_mallocs = 0;
+
+void* bench_malloc(size_t size) {
+    bench_mallocs++;
+    return malloc(size);
+}
+
+void* bench_calloc(size_t n, size_t size) {
+    bench_mallocs++;
+    return calloc(n, size);
+}
+
+void* bench_realloc(void* ptr, size_t size) {
+    bench_mallocs++;
+    return realloc(ptr, size);
+}
+
+char* bench_strdup(const char* s) {
+    bench_mallocs++;
+    return strdup(s);
+}
+
+char* bench_strndup(const char* s, size_t n) {
+    bench_mallocs++;
+    return strndup(s, n);
+}
+
+#undef strdup
+#undef strndup
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#define strdup bench_strdup
+#define strndup bench_strndup
+
+#define JISP_NO_MAIN
+#include "main.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+#undef strndup
+
+typedef struct Workload {
+    const char* name;
+    const char* setup;
+    const char* run;
+} Workload;
+
+// clang-format off
+Workload workloads[] = {
+    {.name = "fib",
+     .setup = "(define (fib n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))",
+     .run = "(fib 22)"},
+    {.name = "tak",
+     .setup = "(define (tak x y z) (if (< y x) (tak (tak (- x 1) y z) (tak (- y 1) z x) (tak (- z 1) x y)) z))",
+     .run = "(tak 18 12 6)"},
+    {.name = "factorial-iter",
+     .setup = "(define (factorial-iter acc x) (if (> x 1) (factorial-iter (* acc x) (- x 1)) acc))",
+     .run = "(factorial-iter 1 1000000)"},
+    {.name = "map",
+     .setup = "(define (iota n acc) (if (> n 0) (iota (- n 1) (prepend acc n)) acc))"
+              "(define numbers (iota 20000 (list 0)))"
+              "(define (add1 x) (+ x 1))"
+              "(define (map-into f l acc) (if (cdr l) (map-into f (cdr l) (append acc (f (car l)))) (append acc (f (car l)))))"
+              "(define (map-repeat n) (if (> n 0) (progn (map-into add1 (cdr numbers) (list (add1 (car numbers)))) (map-repeat (- n 1))) n))",
+     .run = "(map-repeat 10)"},
+    {.name = "filter",
+     .setup = "(define (iota n acc) (if (> n 0) (iota (- n 1) (prepend acc n)) acc))"
+              "(define numbers (iota 20000 (list 0)))"
+              "(define (even? x) (= (% x 2) 0))"
+              "(define (keep p x acc) (if (p x) (append acc x) acc))"
+              "(define (filter-into p l acc) (if (cdr l) (filter-into p (cdr l) (keep p (car l) acc)) (keep p (car l) acc)))"
+              "(define (filter-repeat n) (if (> n 0) (progn (filter-into even? numbers (list 0)) (filter-repeat (- n 1))) n))",
+     .run = "(filter-repeat 10)"},
+    {.name = "reverse",
+     .setup = "(define (iota n acc) (if (> n 0) (iota (- n 1) (prepend acc n)) acc))"
+              "(define numbers (iota 20000 (list 0)))"
+              "(define (reverse-into l acc) (if (cdr l) (reverse-into (cdr l) (prepend acc (car l))) (prepend acc (car l))))"
+              "(define (reverse-repeat n) (if (> n 0) (progn (reverse-into (cdr numbers) (list (car numbers))) (reverse-repeat (- n 1))) n))",
+     .run = "(reverse-repeat 10)"},
+    {.name = "macros",
+     .setup = "(define-macro (unless c body) `(if ,c nil ,body))"
+              "(define-macro (inc x) `(+ ,x 1))"
+              "(define-macro (swap-sub a b) `(- ,b ,a))"
+              "(define (expand-loop n) (if (> n 0) (progn (eval '(unless f (inc (swap-sub 1 2)))) (expand-loop (- n 1))) n))",
+     .run = "(expand-loop 30000)"},
+    {.name = "cond-chain",
+     .setup = "(define (classify x) (cond ((= x 0) 'a) ((= x 1) 'b) ((= x 2) 'c) ((= x 3) 'd) ((= x 4) 'e)"
+              " ((= x 5) 'f) ((= x 6) 'g) ((= x 7) 'h) ((= x 8) 'i) ((= x 9) 'j) ((= x 10) 'k)"
+              " ((= x 11) 'l) ((= x 12) 'm) ((= x 13) 'n) ((= x 14) 'o) ((= x 15) 'p) ((= x 16) 'q)"
+              " ((= x 17) 'r) ((= x 18) 's) ((= x 19) 't) (t 'z)))"
+              "(define (cond-loop n acc) (if (> n 0) (cond-loop (- n 1) (classify (% n 21))) acc))",
+     .run = "(cond-loop 30000 nil)"},
+};
+// clang-format on
+
+typedef struct Result {
+    double seconds;
+    size_t evals;
+    size_t high_water;
+    size_t mallocs;
+} Result;
+
+double bench_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void bench_forms(const char* text, Env* global_env) {
+    Parser input = parser_init((char*)text);
+    run_forms(&input, global_env, false);
+    parser_deinit(&input);
+}
+
+Result bench_run(const Workload* w) {
+    Env global_env;
+    global_env_init(&global_env);
+    bench_forms(w->setup, &global_env);
+
+    bench_mallocs = 0;
+    eval_steps = 0;
+    global_vp.high_water = global_vp.len;
+
+    double start = bench_now();
+    bench_forms(w->run, &global_env);
+    double seconds = bench_now() - start;
+
+    Result r = {.seconds = seconds,
+                .evals = eval_steps,
+                .high_water = global_vp.high_water,
+                .mallocs = bench_mallocs};
+
+    env_deinit(&global_env);
+    vm_deinit(&global_vm);
+
+    return r;
+}
+
+bool bench_selected(const char* name, int argc, char* argv[], int first) {
+    if (first == argc) {
+        return true;
+    }
+
+    for (int i = first; i < argc; i++) {
+        if (!strcmp(name, argv[i])) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Microbenchmarks drive one runtime internal directly. Each one runs at a
+// range of sizes, timing `MICRO_OPS` or so operations per size, so the ns/op
+// column read down a benchmark is its scaling curve.
+#define MICRO_OPS ((size_t)1 << 22)
+
+typedef struct Micro {
+    const char* name;
+    // Returns the seconds spent on `*ops` operations at size `n`
+    double (*run)(size_t n, size_t* ops);
+    size_t sizes[6];
+} Micro;
+
+Symbol* micro_symbol(size_t i) {
+    char name[32];
+    snprintf(name, sizeof(name), "s%zu", i);
+    return intern(name);
+}
+
+size_t micro_rounds(size_t n) { return n < MICRO_OPS ? MICRO_OPS / n : 1; }
+
+// Allocates `n` values then frees them all, per alloc/free pair
+double micro_pool(size_t n, size_t* ops) {
+    Value** values = malloc(n * sizeof(Value*));
+    size_t rounds = micro_rounds(n);
+
+    double start = bench_now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            values[i] = valuepool_alloc(&global_vp);
+        }
+        for (size_t i = 0; i < n; i++) {
+            values[i]->rc = 0;
+            valuepool_free(&global_vp, values[i]);
+        }
+    }
+    double seconds = bench_now() - start;
+
+    free(values);
+    *ops = rounds * n;
+    return seconds;
+}
+
+// Looks up every binding of an `n` entry environment in a scattered order
+double micro_env_get(size_t n, size_t* ops) {
+    Env e = env_init(4, NULL);
+    Symbol** symbols = malloc(n * sizeof(Symbol*));
+    for (size_t i = 0; i < n; i++) {
+        symbols[i] = micro_symbol(i);
+        env_put(&e, symbols[i], value_from_number(i));
+    }
+
+    size_t rounds = micro_rounds(n);
+    double sum = 0;
+
+    double start = bench_now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < n; i++) {
+            sum += value_number(env_get(&e, symbols[(i * 7919) % n]));
+        }
+    }
+    double seconds = bench_now() - start;
+
+    assert(sum > 0 || n == 1);
+    free(symbols);
+    env_deinit(&e);
+    *ops = rounds * n;
+    return seconds;
+}
+
+// Looks up a binding `n` call frames up from the innermost one
+double micro_env_depth(size_t n, size_t* ops) {
+    Env* frames = malloc((n + 1) * sizeof(Env));
+    frames[0] = env_init(64, NULL);
+    for (size_t i = 1; i <= n; i++) {
+        frames[i] = env_init(4, &frames[i - 1]);
+        env_put(&frames[i], micro_symbol(i), value_from_number(i));
+    }
+
+    Symbol* symbol = micro_symbol(1);
+    size_t rounds = MICRO_OPS / 4;
+    double sum = 0;
+
+    double start = bench_now();
+    for (size_t r = 0; r < rounds; r++) {
+        sum += value_number(env_get(&frames[n], symbol));
+    }
+    double seconds = bench_now() - start;
+
+    assert(sum == rounds);
+    for (size_t i = n + 1; i-- > 0;) {
+        env_deinit(&frames[i]);
+    }
+    free(frames);
+    *ops = rounds;
+    return seconds;
+}
+
+// Fills a fresh environment with `n` bindings
+double micro_env_put(size_t n, size_t* ops) {
+    Symbol** symbols = malloc(n * sizeof(Symbol*));
+    for (size_t i = 0; i < n; i++) {
+        symbols[i] = micro_symbol(i);
+    }
+
+    size_t rounds = micro_rounds(n);
+    double seconds = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        double start = bench_now();
+        Env e = env_init(4, NULL);
+        for (size_t i = 0; i < n; i++) {
+            env_put(&e, symbols[i], VALUE_TRUE);
+        }
+        env_deinit(&e);
+        seconds += bench_now() - start;
+    }
+
+    free(symbols);
+    *ops = rounds * n;
+    return seconds;
+}
+
+double micro_parse_text(char* text, size_t n, size_t* ops) {
+    size_t rounds = micro_rounds(n);
+    double seconds = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        Parser input = parser_init(text);
+
+        double start = bench_now();
+        Value* v = parse(&input);
+        seconds += bench_now() - start;
+
+        value_deref(v);
+        parser_deinit(&input);
+    }
+
+    *ops = rounds * n;
+    return seconds;
+}
+
+// Parses a flat list of `n` symbols and numbers, per element
+double micro_parse(size_t n, size_t* ops) {
+    char* text = malloc(n * 8 + 3);
+    char* end = text;
+
+    *end++ = '(';
+    for (size_t i = 0; i < n; i++) {
+        end += sprintf(end, i % 2 ? "%zu " : "s%zu ", i % 1000);
+    }
+    strcpy(end, ")");
+
+    double seconds = micro_parse_text(text, n, ops);
+    free(text);
+    return seconds;
+}
+
+// Parses `n` nested lists, per list
+double micro_parse_nested(size_t n, size_t* ops) {
+    char* text = malloc(n * 2 + 2);
+    memset(text, '(', n);
+    text[n] = 'x';
+    memset(text + n + 1, ')', n);
+    text[n * 2 + 1] = '\0';
+
+    double seconds = micro_parse_text(text, n, ops);
+    free(text);
+    return seconds;
+}
+
+Value* micro_list(size_t n) {
+    Value* v = valuepool_alloc(&global_vp);
+    v->tag = LIST;
+    v->val.list = list_init();
+
+    for (size_t i = 0; i < n; i++) {
+        Value* symbol = valuepool_alloc(&global_vp);
+        symbol->tag = SYMBOL;
+        symbol->val.symbol = &symbol_t;
+        symbol->val.slot = -1;
+
+        list_add(&v->val.list, symbol, false);
+    }
+
+    return v;
+}
+
+// Takes and drops a reference to an `n` element list
+double micro_ref(size_t n, size_t* ops) {
+    Value* v = micro_list(n);
+
+    double start = bench_now();
+    for (size_t r = 0; r < MICRO_OPS; r++) {
+        value_ref(v);
+        value_deref(v);
+    }
+    double seconds = bench_now() - start;
+
+    value_deref(v);
+    *ops = MICRO_OPS;
+    return seconds;
+}
+
+// Drops the last reference to an `n` element list, per element freed
+double micro_free(size_t n, size_t* ops) {
+    size_t rounds = micro_rounds(n);
+    double seconds = 0;
+
+    for (size_t r = 0; r < rounds; r++) {
+        Value* v = micro_list(n);
+
+        double start = bench_now();
+        value_deref(v);
+        seconds += bench_now() - start;
+    }
+
+    *ops = rounds * n;
+    return seconds;
+}
+
+Micro micros[] = {
+    {"pool-alloc-free", micro_pool, {1000, 10000, 100000, 1000000}},
+    {"env-get", micro_env_get, {4, 8, 16, 64, 1024, 65536}},
+    {"env-get-depth", micro_env_depth, {1, 4, 16, 64, 256, 1024}},
+    {"env-put", micro_env_put, {4, 8, 16, 64, 1024, 65536}},
+    {"parse", micro_parse, {10, 1000, 100000, 1000000}},
+    {"parse-nested", micro_parse_nested, {10, 1000, 100000, 1000000}},
+    {"value-ref-deref", micro_ref, {10, 1000, 100000, 1000000}},
+    {"value-free", micro_free, {10, 1000, 100000, 1000000}},
+};
+
+void bench_micros(bool json, int argc, char* argv[], int first_name) {
+    if (json) {
+        printf("{\"micro\": [");
+    } else {
+        printf("%-16s %10s %10s %12s\n", "micro", "n", "ns/op", "ops");
+    }
+
+    bool first = true;
+    size_t len = sizeof(micros) / sizeof(*micros);
+    for (size_t m = 0; m < len; m++) {
+        if (!bench_selected(micros[m].name, argc, argv, first_name)) {
+            continue;
+        }
+
+        for (size_t i = 0; i < 6 && micros[m].sizes[i]; i++) {
+            size_t n = micros[m].sizes[i];
+            size_t ops = 0;
+            double ns = micros[m].run(n, &ops) * 1e9 / ops;
+
+            if (json) {
+                printf("%s\n  {\"name\": \"%s\", \"n\": %zu, "
+                       "\"ns_per_op\": %.3f, \"ops\": %zu}",
+                       first ? "" : ",", micros[m].name, n, ns, ops);
+            } else {
+                printf("%-16s %10zu %10.2f %12zu\n", micros[m].name, n, ns,
+                       ops);
+            }
+            first = false;
+        }
+    }
+
+    if (json) {
+        printf("\n]}\n");
+    }
+}
+
+void bench_workloads(bool json, size_t repeat, int argc, char* argv[],
+                     int first_name) {
+    const char* engine_name = engine == ENGINE_VM ? "vm" : "tree";
+    if (json) {
+        printf("{\"engine\": \"%s\", \"workloads\": [", engine_name);
+    } else {
+        printf("%-16s %10s %14s %12s %10s %10s\n", "workload", "ms", "evals",
+               "evals/s", "pool hw", "mallocs");
+    }
+
+    bool first = true;
+    size_t len = sizeof(workloads) / sizeof(*workloads);
+    for (size_t w = 0; w < len; w++) {
+        if (!bench_selected(workloads[w].name, argc, argv, first_name)) {
+            continue;
+        }
+
+        Result best = {0};
+        for (size_t r = 0; r < repeat || r == 0; r++) {
+            Result result = bench_run(&workloads[w]);
+            if (r == 0 || result.seconds < best.seconds) {
+                best = result;
+            }
+        }
+
+        double per_second = best.evals / best.seconds;
+        if (json) {
+            printf("%s\n  {\"name\": \"%s\", \"seconds\": %.6f, "
+                   "\"evals\": %zu, \"evals_per_second\": %.0f, "
+                   "\"pool_high_water\": %zu, \"mallocs\": %zu}",
+                   first ? "" : ",", workloads[w].name, best.seconds,
+                   best.evals, per_second, best.high_water, best.mallocs);
+        } else {
+            printf("%-16s %10.2f %14zu %12.3g %10zu %10zu\n", workloads[w].name,
+                   best.seconds * 1000, best.evals, per_second, best.high_water,
+                   best.mallocs);
+        }
+        first = false;
+    }
+
+    if (json) {
+        printf("\n]}\n");
+    }
+}
+
+int main(int argc, char* argv[]) {
+    bool json = false;
+    bool micro = false;
+    size_t repeat = 3;
+
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (!strcmp("--json", argv[i])) {
+            json = true;
+        } else if (!strcmp("--micro", argv[i])) {
+            micro = true;
+        } else if (!strcmp("--repeat", argv[i]) && i + 1 < argc &&
+                   parse_size(argv[i + 1], &repeat)) {
+            i++;
+        } else if (!strcmp("--engine", argv[i]) && i + 1 < argc &&
+                   (!strcmp("tree", argv[i + 1]) ||
+                    !strcmp("vm", argv[i + 1]))) {
+            engine = !strcmp("vm", argv[++i]) ? ENGINE_VM : ENGINE_TREE;
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--engine tree|vm] [--repeat n] [--micro] "
+                    "[--json] [name...]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    global_vp = valuepool_init(VP_CHUNK_VALUES, VP_MAX_BYTES);
+    symbols_init();
+
+    if (micro) {
+        bench_micros(json, argc, argv, i);
+    } else {
+        bench_workloads(json, repeat, argc, argv, i);
+    }
+
+    valuepool_deinit(&global_vp);
+    symbols_deinit();
+}
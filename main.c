@@ -1,12 +1,23 @@
+#include "parse_size.h"
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 // (+ 1 2)
 // (if 1 2 3)
@@ -15,26 +26,368 @@
 // (lambda (x y z) (+ x y z))
 // (let ((x 1) (y 2) (z 3)) (+ x y z))
 
+#define PARSER_BUFFER_SIZE 65536
+
+// A source file mapped into memory. Strings parsed from it point straight into
+// the mapping, each one holding a reference that keeps it mapped.
+typedef struct SourceMap {
+    char* base;
+    size_t len;
+    size_t rc;
+} SourceMap;
+
+void sourcemap_release(SourceMap* map) {
+    assert(map->rc >= 1);
+
+    if (--map->rc == 0) {
+        munmap(map->base, map->len);
+        free(map);
+    }
+}
+
 typedef struct Parser {
     char* text;
     size_t pos;
     size_t len;
+
+    // A streaming parser refills `text` from `fd` whenever it runs out, so
+    // only PARSER_BUFFER_SIZE bytes of input are ever held at once. -1 once
+    // there is nothing left to read, or when `text` is the whole input.
+    int fd;
+    char* buffer;
+
+    // Set when `text` is a whole mapped source file, tokens are then sliced
+    // out of it instead of being copied
+    SourceMap* source;
+
+    // The token being read, grown as needed
+    char* token;
+    size_t token_cap;
+
+    // Forms still open while parsing, nesting is kept here rather than on
+    // the C stack
+    struct ParseFrame* stack;
+    size_t stack_len;
+    size_t stack_cap;
 } Parser;
 
-char parser_peek(const Parser* p) { return p->text[p->pos]; }
-char parser_get(Parser* p) { return p->text[p->pos++]; }
+Parser parser_init(char* text) {
+    return (Parser){.text = text, .len = strlen(text), .fd = -1};
+}
+
+Parser parser_init_fd(int fd) {
+    char* buffer = malloc(PARSER_BUFFER_SIZE);
+    return (Parser){.text = buffer, .fd = fd, .buffer = buffer};
+}
+
+// Maps a regular file whole, falling back to streaming it when it can't be
+Parser parser_init_mmap(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        return parser_init_fd(fd);
+    }
+
+    char* base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        return parser_init_fd(fd);
+    }
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    SourceMap* source = malloc(sizeof(SourceMap));
+    *source = (SourceMap){.base = base, .len = st.st_size, .rc = 1};
+
+    return (Parser){
+        .text = base, .len = st.st_size, .fd = -1, .source = source};
+}
+
+void parser_deinit(Parser* p) {
+    free(p->buffer);
+    free(p->token);
+    free(p->stack);
+
+    if (p->source) {
+        sourcemap_release(p->source);
+    }
+}
+
+// Makes sure there is unread input in `text`, returns false at the end of the
+// input
+bool parser_fill(Parser* p) {
+    if (p->pos < p->len) {
+        return true;
+    } else if (p->fd < 0) {
+        return false;
+    }
+
+    ssize_t n = 0;
+    do {
+        n = read(p->fd, p->buffer, PARSER_BUFFER_SIZE);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        fprintf(stderr, "error: reading input: %s\n", strerror(errno));
+    }
+    if (n <= 0) {
+        p->fd = -1;
+        p->pos = p->len = 0;
+        return false;
+    }
+
+    p->pos = 0;
+    p->len = n;
+    return true;
+}
+
+bool parser_eof(Parser* p) { return !parser_fill(p); }
+char parser_peek(Parser* p) { return parser_fill(p) ? p->text[p->pos] : '\0'; }
+char parser_get(Parser* p) {
+    return parser_fill(p) ? p->text[p->pos++] : '\0';
+}
+
+// Skips whitespace and ; comments
 void parser_skip_whitespace(Parser* p) {
-    while (p->text[p->pos] == ' ') {
-        p->pos++;
+    while (!parser_eof(p)) {
+        if (parser_peek(p) == ';') {
+            while (!parser_eof(p) && parser_peek(p) != '\n') {
+                parser_get(p);
+            }
+        } else if (isspace((unsigned char)parser_peek(p))) {
+            parser_get(p);
+        } else {
+            break;
+        }
+    }
+}
+
+void parser_token_put(Parser* p, size_t i, char c) {
+    if (i >= p->token_cap) {
+        p->token_cap = p->token_cap ? p->token_cap * 2 : 256;
+        p->token = realloc(p->token, p->token_cap);
+    }
+
+    p->token[i] = c;
+}
+
+void parser_expect(Parser* p, char c) {
+    if (parser_peek(p) != c) {
+        fprintf(stderr, "error: expected '%c' but found %s\n", c,
+                parser_eof(p) ? "end of input" : "something else");
+        exit(1);
+    }
+
+    parser_get(p);
+}
+
+// Every symbol name is interned exactly once, so two symbols are equal exactly
+// when they point at the same `Symbol`. The name never changes, the counters
+// after it are bookkeeping updated through any reference to the symbol.
+typedef struct Symbol {
+    const char* name;
+    size_t len;
+    uint64_t hash;
+    // How many call frames currently bind this symbol, while zero a lookup can
+    // skip straight to the global env
+    size_t local_bindings;
+    // One past this name's index into the profiler's entries, 0 until a call
+    // by this name is first profiled
+    size_t profile_slot;
+} Symbol;
+
+// Open addressing table of every interned symbol, `cap` is a power of two
+typedef struct SymbolTable {
+    Symbol** slots;
+    size_t cap;
+    size_t len;
+} SymbolTable;
+
+SymbolTable global_symbols;
+
+// Symbols the interpreter itself needs to recognize, registered by
+// `symbols_init` so parsing the same name yields the same pointer
+Symbol symbol_t = {.name = "t"};
+Symbol symbol_f = {.name = "f"};
+Symbol symbol_nil = {.name = "nil"};
+Symbol symbol_rest = {.name = "&rest"};
+Symbol symbol_if = {.name = "if"};
+Symbol symbol_and = {.name = "and"};
+Symbol symbol_or = {.name = "or"};
+Symbol symbol_define = {.name = "define"};
+Symbol symbol_define_macro = {.name = "define-macro"};
+Symbol symbol_progn = {.name = "progn"};
+Symbol symbol_cond = {.name = "cond"};
+Symbol symbol_quasiquote = {.name = "quasiquote"};
+Symbol symbol_unquote = {.name = "unquote"};
+Symbol symbol_unquote_splicing = {.name = "unquote-splicing"};
+Symbol symbol_type_nil = {.name = "#nil"};
+Symbol symbol_type_number = {.name = "#number"};
+Symbol symbol_type_string = {.name = "#string"};
+Symbol symbol_type_boolean = {.name = "#boolean"};
+Symbol symbol_type_procedure = {.name = "#procedure"};
+Symbol symbol_type_specialform = {.name = "#special-form"};
+Symbol symbol_type_builtin = {.name = "#builtin"};
+Symbol symbol_type_symbol = {.name = "#symbol"};
+Symbol symbol_type_list = {.name = "#list"};
+Symbol symbol_type_macro = {.name = "#macro"};
+Symbol symbol_type_cons = {.name = "#cons"};
+
+// FNV-1a
+uint64_t symbol_hash(const char* name, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3;
+    }
+
+    return hash;
+}
+
+Symbol** symboltable_find(const SymbolTable* st, const char* name, size_t len,
+                          uint64_t hash) {
+    size_t mask = st->cap - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Symbol** slot = st->slots + i;
+
+        if (!*slot || ((*slot)->hash == hash && (*slot)->len == len &&
+                       !memcmp((*slot)->name, name, len))) {
+            return slot;
+        }
+    }
+}
+
+void symboltable_grow(SymbolTable* st) {
+    SymbolTable grown = (SymbolTable){
+        .slots = calloc(st->cap ? st->cap * 2 : 64, sizeof(Symbol*)),
+        .cap = st->cap ? st->cap * 2 : 64,
+        .len = st->len,
+    };
+
+    for (size_t i = 0; i < st->cap; i++) {
+        Symbol* s = st->slots[i];
+
+        if (s) {
+            *symboltable_find(&grown, s->name, s->len, s->hash) = s;
+        }
+    }
+
+    free(st->slots);
+    *st = grown;
+}
+
+// Adds a statically allocated symbol to the table, it must not be interned yet
+void symboltable_register(SymbolTable* st, Symbol* s) {
+    if ((st->len + 1) * 2 > st->cap) {
+        symboltable_grow(st);
+    }
+
+    s->len = strlen(s->name);
+    s->hash = symbol_hash(s->name, s->len);
+
+    Symbol** slot = symboltable_find(st, s->name, s->len, s->hash);
+    assert(!*slot);
+
+    *slot = s;
+    st->len++;
+}
+
+Symbol* intern_n(const char* name, size_t len) {
+    SymbolTable* st = &global_symbols;
+    if ((st->len + 1) * 2 > st->cap) {
+        symboltable_grow(st);
+    }
+
+    uint64_t hash = symbol_hash(name, len);
+    Symbol** slot = symboltable_find(st, name, len, hash);
+
+    if (!*slot) {
+        // Name is stored inline, right after the symbol itself
+        Symbol* s = malloc(sizeof(Symbol) + len + 1);
+        char* inline_name = (char*)(s + 1);
+
+        memcpy(inline_name, name, len);
+        inline_name[len] = '\0';
+
+        *s = (Symbol){.name = inline_name, .len = len, .hash = hash};
+        *slot = s;
+        st->len++;
     }
+
+    return *slot;
+}
+
+Symbol* intern(const char* name) { return intern_n(name, strlen(name)); }
+
+void symbols_init() {
+    Symbol* builtin_symbols[] = {
+        &symbol_t,
+        &symbol_f,
+        &symbol_nil,
+        &symbol_rest,
+        &symbol_if,
+        &symbol_and,
+        &symbol_or,
+        &symbol_define,
+        &symbol_define_macro,
+        &symbol_progn,
+        &symbol_cond,
+        &symbol_quasiquote,
+        &symbol_unquote,
+        &symbol_unquote_splicing,
+        &symbol_type_nil,
+        &symbol_type_number,
+        &symbol_type_string,
+        &symbol_type_boolean,
+        &symbol_type_procedure,
+        &symbol_type_specialform,
+        &symbol_type_builtin,
+        &symbol_type_symbol,
+        &symbol_type_list,
+        &symbol_type_macro,
+        &symbol_type_cons,
+    };
+
+    for (size_t i = 0; i < sizeof(builtin_symbols) / sizeof(*builtin_symbols);
+         i++) {
+        symboltable_register(&global_symbols, builtin_symbols[i]);
+    }
+}
+
+void symbols_deinit() {
+    SymbolTable* st = &global_symbols;
+
+    for (size_t i = 0; i < st->cap; i++) {
+        Symbol* s = st->slots[i];
+
+        // Only interned symbols own their memory, registered ones are static
+        if (s && s->name == (const char*)(s + 1)) {
+            free(s);
+        }
+    }
+
+    free(st->slots);
+    *st = (SymbolTable){0};
 }
 
 struct Value;
 
+// Backing array shared by one or more lists. Only `slots[start, end)` is in
+// use, the store owns one reference to each value there. Slots on either side
+// are slack that `list_prepend` and `list_add` can claim without copying.
+typedef struct ListStore {
+    size_t rc;
+    size_t cap;
+    size_t start;
+    size_t end;
+    struct Value* slots[];
+} ListStore;
+
+// A view of `len` values somewhere inside `store`, so a list's cdr can share
+// its store instead of copying it
 typedef struct List {
     struct Value** values;
-    size_t cap;
     size_t len;
+    ListStore* store;
 } List;
 
 typedef struct Cons {
@@ -43,9 +396,28 @@ typedef struct Cons {
 } Cons;
 
 struct Env;
-struct Value* env_get(const struct Env* e, const char* symbol);
+struct Value* env_get(const struct Env* e, Symbol* symbol);
 
 typedef struct Value* (*builtin_procedure)(const struct Value*, struct Env* e);
+// Builtins take their evaluated arguments as an array the caller owns, so a
+// call allocates nothing for them. A builtin returning or keeping an argument
+// takes its own reference.
+typedef struct Value* (*builtin_argv_procedure)(size_t argc,
+                                                 struct Value** argv,
+                                                 struct Env* e);
+
+// A procedure's lambda list, compiled by `signature_of`. Parameters bind to
+// call frame slots in order, a `&rest` list to the slot after them.
+typedef struct Signature {
+    uint32_t required : 31;
+    uint32_t rest : 1;
+    // One past the index of the body's chunk in the VM's compiled procedures,
+    // 0 until the VM first calls it. The chunk is released with the header.
+    uint32_t compiled;
+} Signature;
+
+// The `call_version` of a symbol holding a `Signature` instead of a call cache
+#define SIGNATURE_VERSION UINT32_MAX
 
 typedef enum ValueTag {
     NIL,
@@ -65,74 +437,167 @@ typedef struct Value {
     ValueTag tag;
     union {
         double number;
-        char* string;
+        struct {
+            char* string;
+            size_t string_len;
+            // Set when `string` points into a mapped source file instead of
+            // being owned by the value
+            SourceMap* string_source;
+        };
+        struct {
+            Symbol* symbol;
+            // Position of this symbol in the call frame of the procedure whose
+            // body it appears in, assigned by `resolve_locals`. -1 when the
+            // symbol isn't one of that procedure's parameters.
+            int slot;
+            // At the head of a call, what the symbol last resolved to as the
+            // operator. Valid while `call_version` matches
+            // `global_define_version`, not a counted reference.
+            uint32_t call_version;
+            union {
+                struct Value* call_cache;
+                // On the name heading a procedure's `(name args...)`, while
+                // `call_version` is `SIGNATURE_VERSION`
+                Signature signature;
+            };
+        };
         bool boolean;
         List list;
-        builtin_procedure builtin;
+        struct {
+            // Special forms, and builtins still taking their arguments as a
+            // list, see `builtin_call`
+            builtin_procedure builtin;
+            // NULL for special forms and list style builtins
+            builtin_argv_procedure builtin_argv;
+        };
         Cons cons;
+        // Only meaningful while the value sits on the pool's free list
+        struct Value* next_free;
     } val;
     int quoted;
     int rc;
 } Value;
 
+#define VALUE_TAGS (CONS + 1)
+
+// Counters behind `(runtime-stats)` and `--stats-file`. Allocations per tag are
+// worked out from the frees plus a scan of the live pool, so allocating costs
+// nothing extra. A value counts under the tag it ends up with.
+typedef struct RuntimeStats {
+    size_t frees[VALUE_TAGS];
+    // Values copied by `value_clone`
+    size_t clones[VALUE_TAGS];
+    // List stores grown in place, and copied because another list shared them
+    size_t list_reallocs;
+    size_t list_copies;
+    size_t env_frames;
+    size_t env_depth_peak;
+} RuntimeStats;
+
+RuntimeStats global_stats;
+
 struct ValuePool;
-struct ValuePool valuepool_init(Value*, bool*, size_t);
+struct ValuePool valuepool_init(size_t, size_t);
 Value* valuepool_alloc(struct ValuePool*);
 void valuepool_free(struct ValuePool*, Value*);
 
 struct ValuePool global_vp;
 
-// Increase a value's reference count, and all children
+void list_deinit(List* l);
+
+// Numbers, booleans and nil are immediates, the `Value*` itself encodes them
+// and never points anywhere. Pool values are 8 byte aligned and sit below 2^48,
+// so a double is stored as its bit pattern plus 2^49 (NaNs canonicalized so
+// none wrap around) and nil, false and true are small unaligned words.
+// Immediates are never allocated or refcounted. A quoted number needs its
+// `quoted` count, so it stays boxed in the pool until it's unquoted.
+#define VALUE_DOUBLE_OFFSET ((uint64_t)1 << 49)
+#define VALUE_NIL ((Value*)(uintptr_t)0x2)
+#define VALUE_FALSE ((Value*)(uintptr_t)0x6)
+#define VALUE_TRUE ((Value*)(uintptr_t)0xe)
+
+static_assert(sizeof(Value*) == sizeof(uint64_t),
+              "immediate values need 64 bit pointers");
+
+bool value_immediate(const Value* v) {
+    return (uintptr_t)v >= VALUE_DOUBLE_OFFSET || ((uintptr_t)v & 7) != 0;
+}
+
+Value* value_from_number(double number) {
+    uint64_t bits = 0x7ff8000000000000;
+    if (!isnan(number)) {
+        memcpy(&bits, &number, sizeof(bits));
+    }
+
+    return (Value*)(uintptr_t)(bits + VALUE_DOUBLE_OFFSET);
+}
+
+Value* value_from_boolean(bool boolean) {
+    return boolean ? VALUE_TRUE : VALUE_FALSE;
+}
+
+ValueTag value_tag(const Value* v) {
+    if (!value_immediate(v)) {
+        return v->tag;
+    } else if ((uintptr_t)v >= VALUE_DOUBLE_OFFSET) {
+        return NUMBER;
+    }
+
+    return v == VALUE_NIL ? NIL : BOOLEAN;
+}
+
+double value_number(const Value* v) {
+    if ((uintptr_t)v >= VALUE_DOUBLE_OFFSET) {
+        uint64_t bits = (uintptr_t)v - VALUE_DOUBLE_OFFSET;
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+
+        return number;
+    }
+
+    assert(v->tag == NUMBER);
+    return v->val.number;
+}
+
+bool value_boolean(const Value* v) {
+    if (value_immediate(v)) {
+        assert(v == VALUE_TRUE || v == VALUE_FALSE);
+        return v == VALUE_TRUE;
+    }
+
+    assert(v->tag == BOOLEAN);
+    return v->val.boolean;
+}
+
+int value_quoted(const Value* v) { return value_immediate(v) ? 0 : v->quoted; }
+
+// Increase a value's reference count. Children are owned by their parent, so
+// they keep the single reference the parent holds.
 void value_ref(Value* v) {
-    switch (v->tag) {
-    case PROCEDURE:
-    case MACRO:
-    case LIST:
-        for (size_t i = 0; i < v->val.list.len; i++) {
-            value_ref(v->val.list.values[i]);
-        }
-    case NIL:
-    case NUMBER:
-    case STRING:
-    case BOOLEAN:
-    case BUILTIN:
-    case SYMBOL:
-    case SPECIAL_FORM:
-        v->rc += 1;
-        break;
-    case CONS:
-        v->rc += 1;
-        value_ref(v->val.cons.car);
-        value_ref(v->val.cons.cdr);
+    if (value_immediate(v)) {
+        return;
     }
+
+    v->rc += 1;
 }
 
+void vm_forget_procedure(uint32_t compiled);
+
+// Decrease a value's reference count, releasing the parent's references to its
+// children once nothing refers to it any longer
+// The last child is released by looping rather than recursing, so freeing
+// deeply nested data doesn't grow the C stack
 void value_deref(Value* v) {
-    assert(v->rc >= 1);
+    while (!value_immediate(v)) {
+        assert(v->rc >= 1);
 
-    switch (v->tag) {
-    case PROCEDURE:
-    case MACRO:
-    case LIST:
-        for (size_t i = 0; i < v->val.list.len; i++) {
-            value_deref(v->val.list.values[i]);
-        }
-    case NIL:
-    case NUMBER:
-    case STRING:
-    case BOOLEAN:
-    case BUILTIN:
-    case SYMBOL:
-    case SPECIAL_FORM:
-        v->rc -= 1;
-        break;
-    case CONS:
         v->rc -= 1;
-        value_deref(v->val.cons.car);
-        value_deref(v->val.cons.cdr);
-    }
+        if (v->rc > 0) {
+            return;
+        }
+
+        Value* next = VALUE_NIL;
 
-    if (v->rc == 0) {
         switch (v->tag) {
         case BOOLEAN:
         case NIL:
@@ -140,49 +605,73 @@ void value_deref(Value* v) {
         case BUILTIN:
         case SPECIAL_FORM:
             break;
-        case STRING:
         case SYMBOL:
-            free(v->val.string);
+            if (v->val.call_version == SIGNATURE_VERSION &&
+                v->val.signature.compiled) {
+                vm_forget_procedure(v->val.signature.compiled);
+            }
+            break;
+        case STRING:
+            if (v->val.string_source) {
+                sourcemap_release(v->val.string_source);
+            } else {
+                free(v->val.string);
+            }
             break;
         case PROCEDURE:
         case MACRO:
-        case LIST:
-            free(v->val.list.values);
+        case LIST: {
+            ListStore* store = v->val.list.store;
+            if (store->rc == 1 && store->end > store->start) {
+                next = store->slots[--store->end];
+            }
+
+            list_deinit(&v->val.list);
+            break;
+        }
+        case CONS:
+            value_deref(v->val.cons.car);
+            next = v->val.cons.cdr;
             break;
         }
 
         valuepool_free(&global_vp, v);
+        v = next;
     }
 }
 
 void value_print(const Value* v) {
-    if (v->tag != PROCEDURE) {
-        for (int i = 0; i < v->quoted; i++) {
+    if (value_tag(v) != PROCEDURE) {
+        for (int i = 0; i < value_quoted(v); i++) {
             putchar('\'');
         }
     }
 
-    switch (v->tag) {
+    switch (value_tag(v)) {
     case NIL:
         printf("nil");
         break;
     case NUMBER:
-        printf("%g", v->val.number);
+        printf("%g", value_number(v));
         break;
     case STRING:
-        printf("\"%s\"", v->val.string);
+        printf("\"%.*s\"", (int)v->val.string_len, v->val.string);
         break;
     case BOOLEAN:
-        printf("%s", v->val.boolean ? "t" : "f");
+        printf("%s", value_boolean(v) ? "t" : "f");
         break;
     case SPECIAL_FORM:
         printf("SPECIAL_FORM: 0x%p", v->val.builtin);
         break;
     case BUILTIN:
-        printf("Builtin: 0x%p", v->val.builtin);
+        if (v->val.builtin_argv) {
+            printf("Builtin: 0x%p", v->val.builtin_argv);
+        } else {
+            printf("Builtin: 0x%p", v->val.builtin);
+        }
         break;
     case SYMBOL:
-        printf("%s", v->val.string);
+        printf("%s", v->val.symbol->name);
         break;
     case MACRO:
         printf("(macro ");
@@ -196,8 +685,9 @@ void value_print(const Value* v) {
         printf(")");
         break;
     case PROCEDURE:
-        if (v->quoted) {
-            printf("%s", v->val.list.values[0]->val.list.values[0]->val.string);
+        if (value_quoted(v)) {
+            printf("%s",
+                   v->val.list.values[0]->val.list.values[0]->val.symbol->name);
             break;
         } else {
             printf("Procedure: ");
@@ -218,7 +708,7 @@ void value_print(const Value* v) {
         // cells are lists
         printf("(");
         const Value* current = v;
-        while (current->tag == CONS) {
+        while (value_tag(current) == CONS) {
             value_print(current->val.cons.car);
 
             current = current->val.cons.cdr;
@@ -228,22 +718,117 @@ void value_print(const Value* v) {
     }
 }
 
+size_t format_append(char* buf, size_t cap, size_t len, const char* fmt, ...) {
+    if (len + 1 >= cap) {
+        return len;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + len, cap - len, fmt, args);
+    va_end(args);
+
+    return n < 0 ? len : (len + n < cap - 1 ? len + n : cap - 1);
+}
+
+// Appends `n` bytes of `s` without going through `vsnprintf`, for the plain
+// text `value_format` produces most of
+size_t format_append_str(char* buf, size_t cap, size_t len, const char* s,
+                         size_t n) {
+    if (len + 1 >= cap) {
+        return len;
+    }
+    if (n > cap - 1 - len) {
+        n = cap - 1 - len;
+    }
+
+    memcpy(buf + len, s, n);
+    buf[len + n] = '\0';
+    return len + n;
+}
+
+// Renders `v` the way `value_print` does into `buf` starting at `len`, cut
+// off once `cap` is reached. Returns the new length, `buf` stays terminated.
+size_t value_format(char* buf, size_t cap, size_t len, const Value* v) {
+    if (value_tag(v) != PROCEDURE) {
+        for (int i = 0; i < value_quoted(v); i++) {
+            len = format_append_str(buf, cap, len, "'", 1);
+        }
+    }
+
+    const char* name;
+    switch (value_tag(v)) {
+    case NIL:
+        return format_append_str(buf, cap, len, "nil", 3);
+    case NUMBER:
+        return format_append(buf, cap, len, "%g", value_number(v));
+    case STRING:
+        return format_append(buf, cap, len, "\"%.*s\"",
+                             (int)v->val.string_len, v->val.string);
+    case BOOLEAN:
+        return format_append_str(buf, cap, len,
+                                 value_boolean(v) ? "t" : "f", 1);
+    case SPECIAL_FORM:
+    case BUILTIN:
+        return format_append_str(buf, cap, len, "#builtin", 8);
+    case SYMBOL:
+        return format_append_str(buf, cap, len, v->val.symbol->name,
+                                 strlen(v->val.symbol->name));
+    case PROCEDURE:
+    case MACRO:
+        name = v->val.list.values[0]->val.list.values[0]->val.symbol->name;
+        return format_append_str(buf, cap, len, name, strlen(name));
+    case LIST:
+        len = format_append_str(buf, cap, len, "(", 1);
+        for (size_t i = 0; i < v->val.list.len && len + 1 < cap; i++) {
+            if (i > 0) {
+                len = format_append_str(buf, cap, len, " ", 1);
+            }
+            len = value_format(buf, cap, len, v->val.list.values[i]);
+        }
+        return format_append_str(buf, cap, len, ")", 1);
+    case CONS:
+        len = format_append_str(buf, cap, len, "(", 1);
+        for (const Value* current = v;
+             value_tag(current) == CONS && len + 1 < cap;
+             current = current->val.cons.cdr) {
+            if (current != v) {
+                len = format_append_str(buf, cap, len, " ", 1);
+            }
+            len = value_format(buf, cap, len, current->val.cons.car);
+        }
+        return format_append_str(buf, cap, len, ")", 1);
+    }
+
+    return len;
+}
+
 bool value_truthy(const Value* v) {
-    return !((v->tag == BOOLEAN && v->val.boolean == false) || v->tag == NIL ||
-             (v->tag == NUMBER && v->val.number == 0) ||
-             (v->tag == CONS && v->val.cons.car->tag == NIL) ||
-             (v->tag == STRING && strlen(v->val.string) == 0) ||
-             (v->tag == LIST && v->val.list.len == 0) ||
-             (v->tag == SYMBOL && !strcmp("f", v->val.string)));
+    ValueTag tag = value_tag(v);
+
+    return !((tag == BOOLEAN && value_boolean(v) == false) || tag == NIL ||
+             (tag == NUMBER && value_number(v) == 0) ||
+             (tag == CONS && value_tag(v->val.cons.car) == NIL) ||
+             (tag == STRING && v->val.string_len == 0) ||
+             (tag == LIST && v->val.list.len == 0) ||
+             (tag == SYMBOL && v->val.symbol == &symbol_f));
 }
 
 List list_init();
+List list_init_slack(size_t head, size_t tail);
 void list_add(List* l, Value* v, bool ref);
 
-Value* value_clone(const Value* v) {
+// Copies `v` itself. A list, procedure or macro gets an empty list with room
+// for the elements, which `value_clone` fills in.
+Value* value_clone_node(const Value* v) {
+    if (value_immediate(v)) {
+        return (Value*)v;
+    }
+
     Value* ret = valuepool_alloc(&global_vp);
     ret->tag = v->tag;
     ret->quoted = v->quoted;
+    global_stats.clones[v->tag]++;
 
     switch (v->tag) {
     case NIL:
@@ -252,8 +837,19 @@ Value* value_clone(const Value* v) {
         ret->val.number = v->val.number;
         break;
     case SYMBOL:
+        ret->val.symbol = v->val.symbol;
+        ret->val.slot = v->val.slot;
+        break;
     case STRING:
-        ret->val.string = strdup(v->val.string);
+        ret->val.string_len = v->val.string_len;
+        ret->val.string_source = v->val.string_source;
+
+        if (v->val.string_source) {
+            ret->val.string = v->val.string;
+            v->val.string_source->rc++;
+        } else {
+            ret->val.string = strndup(v->val.string, v->val.string_len);
+        }
         break;
     case BOOLEAN:
         ret->val.boolean = v->val.boolean;
@@ -261,15 +857,12 @@ Value* value_clone(const Value* v) {
     case SPECIAL_FORM:
     case BUILTIN:
         ret->val.builtin = v->val.builtin;
+        ret->val.builtin_argv = v->val.builtin_argv;
         break;
     case PROCEDURE:
     case MACRO:
     case LIST:
-        ret->val.list = list_init();
-
-        for (size_t i = 0; i < v->val.list.len; i++) {
-            list_add(&ret->val.list, value_clone(v->val.list.values[i]), false);
-        }
+        ret->val.list = list_init_slack(0, v->val.list.len);
         break;
     case CONS:
         assert(false);
@@ -279,196 +872,741 @@ Value* value_clone(const Value* v) {
     return ret;
 }
 
-List list_init() {
-    return (List){
-        .values = calloc(3, sizeof(Value)),
-        .cap = 3,
-        .len = 0,
-    };
-}
-
-void list_add(List* l, Value* v, bool ref) {
-    if (l->len >= l->cap) {
-        l->cap *= 2;
-        l->values = realloc(l->values, l->cap * sizeof(*l->values));
+// Moves an immediate into the pool so it can carry a `quoted` count
+Value* value_box(Value* v) {
+    if (!value_immediate(v)) {
+        return v;
     }
 
-    l->values[l->len++] = v;
-    if (ref) {
-        value_ref(v);
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = value_tag(v);
+
+    if (ret->tag == NUMBER) {
+        ret->val.number = value_number(v);
+    } else if (ret->tag == BOOLEAN) {
+        ret->val.boolean = value_boolean(v);
     }
+
+    return ret;
 }
 
-Value* internal_car(List l) {
-    assert(l.len > 0);
+// Copies a quoted value with one level of quoting removed, unboxing it when it
+// no longer needs to live in the pool
+bool value_has_list(const Value* v) {
+    ValueTag tag = value_tag(v);
+    return tag == LIST || tag == PROCEDURE || tag == MACRO;
+}
 
-    value_ref(l.values[0]);
+// A list whose elements are still to be copied into `to`
+typedef struct CloneFrame {
+    const Value* from;
+    Value* to;
+} CloneFrame;
 
-    return l.values[0];
-}
+// Deep copies `v`. Nested lists are copied off an explicit stack instead of by
+// recursion, so anything the parser can read can be copied.
+Value* value_clone(const Value* v) {
+    Value* ret = value_clone_node(v);
+    if (!value_has_list(v)) {
+        return ret;
+    }
 
-// We're passed a list that looks like (arg1 arg2 arg3)
-// For car this means ((arg1)), where arg1 is a list
-// In essence car only accepts 1 argument
-Value* car(const Value* v, struct Env* _) {
-    assert(v->tag == LIST ||
-           v->tag == PROCEDURE); // Maybe need to add procedure?
-    assert(v->val.list.len == 1);
+    CloneFrame small_stack[16];
+    CloneFrame* stack = small_stack;
+    size_t cap = sizeof(small_stack) / sizeof(*small_stack);
+    size_t len = 0;
 
-    return internal_car(v->val.list.values[0]->val.list);
-}
+    stack[len++] = (CloneFrame){.from = v, .to = ret};
 
-Value* internal_cdr(List l) {
-    List out = list_init();
+    while (len > 0) {
+        CloneFrame frame = stack[--len];
 
-    for (size_t i = 1; i < l.len; i++) {
-        list_add(&out, l.values[i], true);
+        for (size_t i = 0; i < frame.from->val.list.len; i++) {
+            const Value* element = frame.from->val.list.values[i];
+            Value* copy = value_clone_node(element);
+            list_add(&frame.to->val.list, copy, false);
+
+            if (!value_has_list(element) || element->val.list.len == 0) {
+                continue;
+            }
+
+            if (len == cap) {
+                cap *= 2;
+                if (stack == small_stack) {
+                    stack = malloc(cap * sizeof(*stack));
+                    memcpy(stack, small_stack, sizeof(small_stack));
+                } else {
+                    stack = realloc(stack, cap * sizeof(*stack));
+                }
+            }
+            stack[len++] = (CloneFrame){.from = element, .to = copy};
+        }
     }
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = LIST;
-    ret->val.list = out;
+    if (stack != small_stack) {
+        free(stack);
+    }
 
     return ret;
 }
 
-Value* cdr(const Value* v, struct Env* e) {
-    assert(v->tag == LIST || v->tag == PROCEDURE);
-    assert(v->val.list.len == 1);
+Value* value_unquote(const Value* v) {
+    Value* ret = value_clone(v);
+    ret->quoted--;
 
-    Value* arg1 = v->val.list.values[0];
-    assert(arg1->tag == LIST || arg1->tag == PROCEDURE || arg1->tag == MACRO);
-    assert(arg1->val.list.len >= 1);
+    if (ret->quoted > 0) {
+        return ret;
+    }
+
+    Value* immediate = ret;
+    if (ret->tag == NUMBER) {
+        immediate = value_from_number(ret->val.number);
+    } else if (ret->tag == BOOLEAN) {
+        immediate = value_from_boolean(ret->val.boolean);
+    } else if (ret->tag == NIL) {
+        immediate = VALUE_NIL;
+    }
+
+    if (immediate != ret) {
+        value_deref(ret);
+    }
+
+    return immediate;
+}
+
+// A list with room for `head` prepends and `tail` appends before it has to
+// move to a bigger store
+List list_init_slack(size_t head, size_t tail) {
+    size_t cap = head + tail ? head + tail : 1;
+    ListStore* store = malloc(sizeof(ListStore) + cap * sizeof(Value*));
+    *store = (ListStore){.rc = 1, .cap = cap, .start = head, .end = head};
+
+    return (List){.values = store->slots + head, .len = 0, .store = store};
+}
+
+List list_init() { return list_init_slack(0, 3); }
+
+void list_deinit(List* l) {
+    ListStore* store = l->store;
+    assert(store->rc >= 1);
+
+    if (--store->rc == 0) {
+        for (size_t i = store->start; i < store->end; i++) {
+            value_deref(store->slots[i]);
+        }
+
+        free(store);
+    }
+
+    *l = (List){0};
+}
+
+// Returns another view of the same values, sharing the store
+List list_share(List l) {
+    l.store->rc++;
+    return l;
+}
+
+// Copies the view into a store of its own with the given slack on either side
+void list_unshare(List* l, size_t head, size_t tail) {
+    List copy = list_init_slack(head, l->len + tail);
+    global_stats.list_copies++;
+
+    for (size_t i = 0; i < l->len; i++) {
+        value_ref(l->values[i]);
+        copy.values[i] = l->values[i];
+    }
+    copy.len = l->len;
+    copy.store->end += l->len;
+
+    list_deinit(l);
+    *l = copy;
+}
+
+void list_add(List* l, Value* v, bool ref) {
+    ListStore* store = l->store;
+    size_t end = l->values + l->len - store->slots;
+
+    // The slot after the view has to be unclaimed by any other view
+    if (end != store->end || end == store->cap) {
+        if (store->rc == 1 && end == store->end) {
+            size_t offset = l->values - store->slots;
+
+            store->cap *= 2;
+            store = realloc(store, sizeof(ListStore) +
+                                       store->cap * sizeof(Value*));
+            global_stats.list_reallocs++;
+            l->values = store->slots + offset;
+            l->store = store;
+        } else {
+            list_unshare(l, 0, l->len + 1);
+            store = l->store;
+        }
+    }
+
+    l->values[l->len++] = v;
+    store->end++;
+
+    if (ref) {
+        value_ref(v);
+    }
+}
+
+// Adds `v` in front of the view, in O(1) unless the slot before it is taken
+void list_prepend(List* l, Value* v, bool ref) {
+    ListStore* store = l->store;
+    size_t start = l->values - store->slots;
+
+    if (start != store->start || start == 0) {
+        list_unshare(l, l->len + 1, 0);
+        store = l->store;
+    }
+
+    l->values--;
+    l->len++;
+    l->values[0] = v;
+    store->start--;
+
+    if (ref) {
+        value_ref(v);
+    }
+}
+
+// Replaces the value at `i`, taking over the caller's reference to `v`. Other
+// views of the same store keep seeing the old value.
+void list_set(List* l, size_t i, Value* v) {
+    assert(i < l->len);
+
+    if (l->store->rc > 1) {
+        list_unshare(l, 0, 0);
+    }
+
+    value_deref(l->values[i]);
+    l->values[i] = v;
+}
+
+Value* internal_car(List l) {
+    assert(l.len > 0);
+
+    value_ref(l.values[0]);
+
+    return l.values[0];
+}
+
+// car only accepts 1 argument, a list (or procedure, which is one too)
+Value* car(size_t argc, Value** argv, struct Env* _) {
+    assert(argc == 1);
+
+    return internal_car(argv[0]->val.list);
+}
+
+// Shares `l`'s store, so taking the cdr is O(1)
+Value* internal_cdr(List l) {
+    List out = list_share(l);
+    if (out.len > 0) {
+        out.values++;
+        out.len--;
+    }
+
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = LIST;
+    ret->val.list = out;
+
+    return ret;
+}
+
+Value* cdr(size_t argc, Value** argv, struct Env* e) {
+    assert(argc == 1);
+
+    Value* arg1 = argv[0];
+    assert(value_tag(arg1) == LIST || value_tag(arg1) == PROCEDURE ||
+           value_tag(arg1) == MACRO);
+    assert(arg1->val.list.len >= 1);
 
     List arg1_list = arg1->val.list;
 
     if (arg1_list.len <= 1) {
-        return env_get(e, "nil");
+        return env_get(e, &symbol_nil);
     }
 
     return internal_cdr(arg1_list);
 }
 
-typedef struct ValuePool {
+// The value heap is made of chunks that are mapped on demand. Every chunk is
+// aligned to its own (power of two) size, so the chunk owning a value can be
+// found by masking the value's address. Values never move once allocated.
+typedef struct ValueChunk {
+    struct ValueChunk* prev;
+    struct ValueChunk* next;
+
     Value* values;
     bool* in_use;
+    // Freed values are threaded through `val.next_free`, so both alloc and
+    // free are O(1). Slots past `high_water` have never been handed out.
+    Value* free_list;
     size_t cap;
     size_t len;
+    size_t high_water;
+} ValueChunk;
+
+typedef struct ValuePool {
+    // Chunks with at least one free slot, and chunks that are completely full
+    ValueChunk* available;
+    ValueChunk* full;
+    // One empty chunk is kept around so a pool hovering at a chunk boundary
+    // doesn't map and unmap on every allocation
+    ValueChunk* spare;
+
+    size_t chunk_size;
+    size_t chunk_cap;
+    size_t chunks;
+    size_t max_chunks;
+
+    size_t len;
+    size_t high_water;
+    // Every allocation ever made, the profiler attributes the difference
+    size_t allocs;
 } ValuePool;
 
-ValuePool valuepool_init(Value* value_buf, bool* used_buf, size_t cap) {
+#define VP_CHUNK_VALUES 4096
+#define VP_MAX_BYTES ((size_t)1 << 32)
+#define VP_MIN_CHUNK_SIZE ((size_t)1 << 16)
+
+ValuePool valuepool_init(size_t chunk_values, size_t max_bytes) {
+    size_t per_value = sizeof(Value) + sizeof(bool);
+    size_t overhead = sizeof(ValueChunk) + alignof(Value);
+
+    // Chunk sizes are doubled from a power of two, none fits past SIZE_MAX / 2
+    if (chunk_values > (SIZE_MAX - overhead) / per_value ||
+        overhead + chunk_values * per_value > SIZE_MAX / 2 + 1) {
+        fprintf(stderr, "error: a chunk can't hold %zu values\n",
+                chunk_values);
+        exit(1);
+    }
+
+    size_t chunk_size = VP_MIN_CHUNK_SIZE;
+    while (chunk_size < overhead + chunk_values * per_value) {
+        chunk_size *= 2;
+    }
+
+    size_t max_chunks = max_bytes / chunk_size;
+
     return (ValuePool){
-        .values = value_buf,
-        .in_use = used_buf,
-        .cap = cap,
-        .len = 0,
+        .chunk_size = chunk_size,
+        .chunk_cap = (chunk_size - overhead) / per_value,
+        .max_chunks = max_chunks ? max_chunks : 1,
     };
 }
 
+void valuechunk_unlink(ValueChunk** head, ValueChunk* c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        *head = c->next;
+    }
+
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+
+    c->prev = NULL;
+    c->next = NULL;
+}
+
+void valuechunk_push(ValueChunk** head, ValueChunk* c) {
+    c->prev = NULL;
+    c->next = *head;
+
+    if (*head) {
+        (*head)->prev = c;
+    }
+
+    *head = c;
+}
+
+ValueChunk* valuechunk_map(const ValuePool* vp) {
+    // Over-map by a whole chunk so an aligned window is guaranteed to fit,
+    // then hand the slop on either side straight back
+    size_t size = vp->chunk_size;
+    char* raw = mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    char* aligned =
+        (char*)(((uintptr_t)raw + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (aligned + size != raw + size * 2) {
+        munmap(aligned + size, (raw + size * 2) - (aligned + size));
+    }
+
+    // Fresh mappings are zero filled, so in_use starts out all false
+    ValueChunk* c = (ValueChunk*)aligned;
+    c->in_use = (bool*)(c + 1);
+    uintptr_t values = (uintptr_t)(c->in_use + vp->chunk_cap);
+    c->values = (Value*)((values + alignof(Value) - 1) &
+                         ~(uintptr_t)(alignof(Value) - 1));
+    c->cap = vp->chunk_cap;
+
+    return c;
+}
+
+void valuechunk_unmap(const ValuePool* vp, ValueChunk* c) {
+    munmap(c, vp->chunk_size);
+}
+
 void valuepool_deinit(ValuePool* vp) {
     if (vp->len != 0) {
         printf("vp len is %zu\n", vp->len);
     }
     assert(vp->len == 0);
+
+    // Every chunk is empty, so they can only be sitting in these two places
+    assert(vp->full == NULL);
+    while (vp->available) {
+        ValueChunk* c = vp->available;
+        valuechunk_unlink(&vp->available, c);
+        valuechunk_unmap(vp, c);
+    }
+    if (vp->spare) {
+        valuechunk_unmap(vp, vp->spare);
+        vp->spare = NULL;
+    }
 }
 
 Value* valuepool_alloc(ValuePool* vp) {
-    assert(vp->len < vp->cap);
+    if (!vp->available) {
+        ValueChunk* c = vp->spare;
+        vp->spare = NULL;
 
-    for (size_t i = 0; i < vp->cap; i++) {
-        if (!vp->in_use[i]) {
-            vp->in_use[i] = true;
-            vp->values[i] = (Value){.rc = 1};
-            vp->len++;
+        if (!c) {
+            if (vp->chunks >= vp->max_chunks ||
+                !(c = valuechunk_map(vp))) {
+                fprintf(stderr,
+                        "error: value heap exhausted, %zu chunks of %zu "
+                        "bytes in use\n",
+                        vp->chunks, vp->chunk_size);
+                exit(1);
+            }
 
-            return vp->values + i;
+            vp->chunks++;
         }
+
+        valuechunk_push(&vp->available, c);
     }
 
-    assert(false);
-    return NULL;
+    ValueChunk* c = vp->available;
+    Value* ret = NULL;
+    if (c->free_list) {
+        ret = c->free_list;
+        c->free_list = ret->val.next_free;
+    } else {
+        assert(c->high_water < c->cap);
+        ret = c->values + c->high_water++;
+    }
+
+    ptrdiff_t offset = ret - c->values;
+    assert(!c->in_use[offset]);
+
+    c->in_use[offset] = true;
+    *ret = (Value){.rc = 1};
+    c->len++;
+
+    if (c->len == c->cap) {
+        valuechunk_unlink(&vp->available, c);
+        valuechunk_push(&vp->full, c);
+    }
+
+    vp->len++;
+    vp->allocs++;
+    if (vp->len > vp->high_water) {
+        vp->high_water = vp->len;
+    }
+
+    return ret;
 }
 
 void valuepool_free(ValuePool* vp, Value* v) {
-    assert(vp->values <= v && v <= (vp->values + vp->cap));
     assert(v->rc == 0);
+    global_stats.frees[v->tag]++;
+
+    ValueChunk* c =
+        (ValueChunk*)((uintptr_t)v & ~(uintptr_t)(vp->chunk_size - 1));
+    assert(c->values <= v && v < (c->values + c->cap));
 
-    ptrdiff_t offset = v - vp->values;
+    ptrdiff_t offset = v - c->values;
+    assert(c->in_use[offset]);
 
-    vp->in_use[offset] = false;
+    c->in_use[offset] = false;
+    v->val.next_free = c->free_list;
+    c->free_list = v;
+
+    if (c->len == c->cap) {
+        valuechunk_unlink(&vp->full, c);
+        valuechunk_push(&vp->available, c);
+    }
+
+    c->len--;
     vp->len--;
+
+    if (c->len == 0) {
+        valuechunk_unlink(&vp->available, c);
+
+        if (vp->spare) {
+            valuechunk_unmap(vp, c);
+            vp->chunks--;
+        } else {
+            vp->spare = c;
+        }
+    }
 }
 
-Value t = (Value){.tag = BOOLEAN, .val.boolean = true, .rc = 2};
-Value f = (Value){.tag = BOOLEAN, .val.boolean = false, .rc = 2};
-Value nil = (Value){.tag = NIL, .rc = 2};
-Value type_nil = (Value){.tag = SYMBOL, .val.string = "#nil", .rc = 2};
-Value type_number = (Value){.tag = SYMBOL, .val.string = "#number", .rc = 2};
-Value type_string = (Value){.tag = SYMBOL, .val.string = "#string", .rc = 2};
-Value type_boolean = (Value){.tag = SYMBOL, .val.string = "#boolean", .rc = 2};
+// Adds the values currently handed out to `live`, by tag
+void valuepool_count_live(const ValuePool* vp, size_t live[VALUE_TAGS]) {
+    const ValueChunk* chunks[] = {vp->available, vp->full};
+
+    for (size_t i = 0; i < 2; i++) {
+        for (const ValueChunk* c = chunks[i]; c; c = c->next) {
+            for (size_t j = 0; j < c->high_water; j++) {
+                if (c->in_use[j]) {
+                    live[c->values[j].tag]++;
+                }
+            }
+        }
+    }
+}
+
+Value type_nil =
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_nil, .rc = 2};
+Value type_number =
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_number, .rc = 2};
+Value type_string =
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_string, .rc = 2};
+Value type_boolean =
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_boolean, .rc = 2};
 Value type_procedure =
-    (Value){.tag = SYMBOL, .val.string = "#procedure", .rc = 2};
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_procedure, .rc = 2};
 Value type_specialform =
-    (Value){.tag = SYMBOL, .val.string = "#special-form", .rc = 2};
-Value type_symbol = (Value){.tag = SYMBOL, .val.string = "#symbol", .rc = 2};
-Value type_list = (Value){.tag = SYMBOL, .val.string = "#list", .rc = 2};
-Value type_macro = (Value){.tag = SYMBOL, .val.string = "#macro", .rc = 2};
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_specialform, .rc = 2};
+Value type_symbol =
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_symbol, .rc = 2};
+Value type_list =
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_list, .rc = 2};
+Value type_macro =
+    (Value){.tag = SYMBOL, .val.symbol = &symbol_type_macro, .rc = 2};
+
+// Frames holding more bindings than this (in practice the global env) get an
+// open addressing index over `keys`, small call frames stay a linear scan
+#define ENV_LINEAR_MAX 8
 
 typedef struct Env {
     struct Env* parent;
+    // The global env at the bottom of the chain, NULL in the global env itself
+    struct Env* root;
+    // Frames between this one and the global env
+    size_t depth;
 
-    char** keys;
+    Symbol** keys;
     Value** vals;
     size_t len;
     size_t cap;
+
+    // Each slot holds a position in `keys` plus one, zero marks an empty slot.
+    // `index_cap` is a power of two, kept at least twice `len`
+    size_t* index;
+    size_t index_cap;
 } Env;
 
-Env env_init() {
+// Bumped whenever a global binding changes or a global env comes or goes,
+// invalidating every call site cache. Starts at 1 so a freshly allocated
+// symbol, with `call_version` zero, never looks cached, and skips
+// `SIGNATURE_VERSION`.
+uint32_t global_define_version = 1;
+
+void global_define_bump() {
+    if (++global_define_version == SIGNATURE_VERSION) {
+        global_define_version = 1;
+    }
+}
+
+// A new frame under `parent`, with no room for bindings yet
+Env env_link(Env* parent) {
+    size_t depth = parent ? parent->depth + 1 : 0;
+
+    global_stats.env_frames++;
+    if (!parent) {
+        global_define_bump();
+    }
+    if (depth > global_stats.env_depth_peak) {
+        global_stats.env_depth_peak = depth;
+    }
+
     return (Env){
-        .keys = calloc(3, sizeof(char*)),
-        .vals = calloc(3, sizeof(Value*)),
-        .len = 0,
-        .cap = 3,
+        .parent = parent,
+        .root = parent ? (parent->root ? parent->root : parent) : NULL,
+        .depth = depth,
     };
 }
 
+Env env_init(size_t size, Env* parent) {
+    size = size ? size : 1;
+
+    Env ret = env_link(parent);
+    ret.keys = calloc(size, sizeof(Symbol*));
+    ret.vals = calloc(size, sizeof(Value*));
+    ret.cap = size;
+
+    return ret;
+}
+
+// Sets up a frame emptied by `env_clear` as a new one like `env_init` does,
+// keeping its storage when there's room for `size` bindings
+void env_reinit(Env* e, size_t size, Env* parent) {
+    size = size ? size : 1;
+    Symbol** keys = e->keys;
+    Value** vals = e->vals;
+    size_t cap = e->cap;
+
+    if (size > cap) {
+        keys = realloc(keys, size * sizeof(*keys));
+        vals = realloc(vals, size * sizeof(*vals));
+        cap = size;
+    }
+
+    *e = env_link(parent);
+    e->keys = keys;
+    e->vals = vals;
+    e->cap = cap;
+}
+
+// Drops every binding of `e` but keeps its storage
+void env_clear(Env* e) {
+    for (size_t i = 0; i < e->len; i++) {
+        value_deref(e->vals[i]);
+
+        if (e->parent) {
+            e->keys[i]->local_bindings--;
+        }
+    }
+
+    free(e->index);
+    e->index = NULL;
+    e->index_cap = 0;
+    e->len = 0;
+}
+
 void env_deinit(Env* e) {
     if (e) {
-        for (size_t i = 0; i < e->len; i++) {
-            free(e->keys[i]);
-            value_deref(e->vals[i]);
+        if (!e->parent) {
+            global_define_bump();
         }
 
+        env_clear(e);
+
         free(e->keys);
         free(e->vals);
     }
 }
 
-Value* env_get(const Env* e, const char* symbol) {
-    if (!e) {
-        return &nil;
+// Returns the position of `symbol` in `e->keys`, or `e->len` if it isn't bound
+// in this frame
+size_t env_find(const Env* e, Symbol* symbol) {
+    if (e->index) {
+        size_t mask = e->index_cap - 1;
+
+        for (size_t i = symbol->hash & mask; e->index[i]; i = (i + 1) & mask) {
+            if (e->keys[e->index[i] - 1] == symbol) {
+                return e->index[i] - 1;
+            }
+        }
+
+        return e->len;
     }
 
     for (size_t i = 0; i < e->len; i++) {
-        if (!strcmp(symbol, e->keys[i])) {
-            value_ref(e->vals[i]);
-            return e->vals[i];
+        if (symbol == e->keys[i]) {
+            return i;
         }
     }
 
-    return env_get(e->parent, symbol);
+    return e->len;
+}
+
+void env_index_insert(Env* e, size_t pos) {
+    size_t mask = e->index_cap - 1;
+    size_t i = e->keys[pos]->hash & mask;
+
+    while (e->index[i]) {
+        i = (i + 1) & mask;
+    }
+
+    e->index[i] = pos + 1;
 }
 
-void env_put(Env* e, const char* symbol, Value* v) {
+void env_reindex(Env* e) {
+    free(e->index);
+
+    e->index_cap = 16;
+    while (e->index_cap < e->len * 2) {
+        e->index_cap *= 2;
+    }
+
+    e->index = calloc(e->index_cap, sizeof(*e->index));
     for (size_t i = 0; i < e->len; i++) {
-        if (!strcmp(symbol, e->keys[i])) {
-            // If we find a duplicate key, replace the old value
-            value_deref(e->vals[i]);
-            value_ref(v);
-            e->vals[i] = v;
+        env_index_insert(e, i);
+    }
+}
 
-            return;
-        }
+Value* env_get(const Env* e, Symbol* symbol) {
+    if (!e) {
+        return VALUE_NIL;
+    }
+
+    if (symbol->local_bindings == 0 && e->root) {
+        e = e->root;
+    }
+
+    size_t i = env_find(e, symbol);
+    if (i < e->len) {
+        value_ref(e->vals[i]);
+        return e->vals[i];
+    }
+
+    return env_get(e->parent, symbol);
+}
+
+// Looks up a symbol reference, trying the frame slot assigned by
+// `resolve_locals` before falling back to a lookup by name. The slot is only a
+// hint, it is checked against the frame's keys so a reference evaluated in
+// some other frame still finds the right binding.
+Value* env_get_ref(const Env* e, const Value* ref) {
+    assert(value_tag(ref) == SYMBOL);
+
+    if (e && ref->val.slot >= 0 && (size_t)ref->val.slot < e->len &&
+        e->keys[ref->val.slot] == ref->val.symbol) {
+        value_ref(e->vals[ref->val.slot]);
+        return e->vals[ref->val.slot];
+    }
+
+    return env_get(e, ref->val.symbol);
+}
+
+void env_put(Env* e, Symbol* symbol, Value* v) {
+    if (!e->parent) {
+        global_define_bump();
+    }
+
+    size_t i = env_find(e, symbol);
+    if (i < e->len) {
+        // If we find a duplicate key, replace the old value
+        value_deref(e->vals[i]);
+        value_ref(v);
+        e->vals[i] = v;
+
+        return;
     }
 
     // If we don't find it, add a new entry
@@ -478,184 +1616,879 @@ void env_put(Env* e, const char* symbol, Value* v) {
         e->vals = realloc(e->vals, e->cap * sizeof(*e->vals));
     }
 
-    e->keys[e->len] = strdup(symbol);
+    e->keys[e->len] = symbol;
     e->vals[e->len] = v;
     value_ref(v);
     e->len++;
-}
 
-void env_print(const Env* e) {
-    for (size_t i = 0; i < e->len; i++) {
-        printf("%10s --> ", e->keys[i]);
-        value_print(e->vals[i]);
-        printf("\n");
+    if (e->parent) {
+        symbol->local_bindings++;
     }
-}
-
-Value* handle_if(const Value*, Env*);
-Value* handle_define(const Value*, Env*);
-Value* handle_and(const Value*, Env*);
-Value* handle_or(const Value*, Env*);
-Value* handle_progn(const Value*, Env*);
-Value* handle_cond(const Value*, Env*);
 
-Value* parse(Parser* input);
-// TODO I think we're going to need a similar internal_eval and eval split as we
-// needed with car and cdr
-// The issue is I want to call with a list from my C code, but from the lisp
-// code it makes more sense to call with a list of args where eval expects a
-// single arg
-Value* internal_eval(const Value* v, Env* e) {
-    if (v->quoted) {
-        Value* ret = value_clone(v);
-        ret->quoted--;
+    if (e->index && e->len * 2 <= e->index_cap) {
+        env_index_insert(e, e->len - 1);
+    } else if (e->len > ENV_LINEAR_MAX) {
+        env_reindex(e);
+    }
+}
 
-        return ret;
-    } else if (v->tag == LIST) {
-        Value* procedure = internal_eval(v->val.list.values[0], e);
-        Value* ret_val = NULL;
-
-        if (procedure->tag == SPECIAL_FORM) {
-            // Special forms evaluate their own arguments
-            return procedure->val.builtin(v, e);
-        } else if (procedure->tag == MACRO) {
-            Value* arguments = internal_cdr(v->val.list);
-            Value* macro_arg_names = procedure->val.list.values[0];
-            List macro_arg_names_list = macro_arg_names->val.list;
-            Value* macro_body = procedure->val.list.values[1];
-
-            Env macrocall_env = env_init();
-            macrocall_env.parent = e;
-
-            for (size_t i = 1; i < macro_arg_names_list.len; i++) {
-                env_put(&macrocall_env,
-                        macro_arg_names_list.values[i]->val.string,
-                        arguments->val.list.values[i - 1]);
-            }
-            value_deref(arguments);
-
-            Value* macro_eval = internal_eval(macro_body, &macrocall_env);
-            env_deinit(&macrocall_env);
-
-            ret_val = internal_eval(macro_eval, e);
-
-            value_deref(macro_eval);
-        } else if (procedure->tag == BUILTIN) {
-            Value* arguments = internal_cdr(v->val.list);
-            // Now evaluate all of the arguments to prepare them for the
-            // builtin
-            List evaluated_args = list_init();
-            for (size_t i = 0; i < arguments->val.list.len; i++) {
-                list_add(&evaluated_args,
-                         internal_eval(arguments->val.list.values[i], e),
-                         false);
-            }
+// Evaluates the operator of a call. A symbol no call frame binds resolves in
+// the global env, so the call site keeps what it found on the symbol's own node
+// and skips the lookup until a global definition changes.
+Value* env_get_operator(const Env* e, Value* head) {
+    if (value_tag(head) != SYMBOL || value_quoted(head) ||
+        head->val.symbol->local_bindings != 0) {
+        return NULL;
+    }
 
-            Value* builtin_args = valuepool_alloc(&global_vp);
-            builtin_args->tag = LIST;
-            builtin_args->val.list = evaluated_args;
+    if (head->val.call_version != global_define_version) {
+        Value* ret = env_get(e, head->val.symbol);
+        value_deref(ret);
 
-            ret_val = procedure->val.builtin(builtin_args, e);
+        head->val.call_cache = ret;
+        head->val.call_version = global_define_version;
+    }
 
-            value_deref(builtin_args);
-            value_deref(arguments);
-        } else if (procedure->tag == PROCEDURE) {
-            assert(procedure->val.list.values[0]->tag == LIST);
-            assert(procedure->val.list.values[1]->tag == LIST ||
-                   procedure->val.list.values[1]->tag == SYMBOL);
+    value_ref(head->val.call_cache);
+    return head->val.call_cache;
+}
 
-            List name_args = procedure->val.list.values[0]->val.list;
-            Value* func_body = procedure->val.list.values[1];
+// Adds a binding the caller knows `e` doesn't have yet, taking over the
+// caller's reference to `v`. Call frames are sized for their parameters up
+// front, so this never grows the frame.
+void env_bind(Env* e, Symbol* symbol, Value* v) {
+    assert(e->len < e->cap);
 
-            Env funcall_env = env_init();
-            funcall_env.parent = e;
-            bool rest = false;
+    e->keys[e->len] = symbol;
+    e->vals[e->len] = v;
+    e->len++;
 
-            // Map the provided arguments into the funcall_env
-            for (size_t i = 1; i < name_args.len; i++) {
-                if (!strcmp("&rest", name_args.values[i]->val.string)) {
-                    rest = true;
+    if (e->parent) {
+        symbol->local_bindings++;
+    }
 
-                    // Map all remaining arguments into a list with name at
-                    // [i+1]
-                    List rest_args = list_init();
+    if (e->index && e->len * 2 <= e->index_cap) {
+        env_index_insert(e, e->len - 1);
+    } else if (e->len > ENV_LINEAR_MAX) {
+        env_reindex(e);
+    }
+}
 
-                    for (size_t j = i; j < v->val.list.len; j++) {
-                        Value* eval_result =
-                            internal_eval(v->val.list.values[j], e);
+// Whether `callee` binds every name `caller` does. Only then can a tail call
+// drop the caller's frame, under dynamic scope the callee could otherwise see
+// through to its bindings.
+bool env_shadows(const Env* callee, const Env* caller) {
+    for (size_t i = 0; i < caller->len; i++) {
+        if (env_find(callee, caller->keys[i]) == callee->len) {
+            return false;
+        }
+    }
 
-                        list_add(&rest_args, eval_result, false);
-                    }
+    return true;
+}
 
-                    Value* rest = valuepool_alloc(&global_vp);
-                    rest->tag = LIST;
-                    rest->val.list = rest_args;
+// Moves a call frame onto the parent of the frame it's replacing
+void env_reparent(Env* e, Env* parent) {
+    e->parent = parent;
+    e->root = parent->root ? parent->root : parent;
+    e->depth = parent->depth + 1;
+}
 
-                    env_put(&funcall_env, name_args.values[i + 1]->val.string,
-                            rest);
+// Compiles the lambda list of a procedure header `(name [arg...] [&rest args])`
+// when it's defined, or when a copy of it is first called, and keeps it on the
+// header's name
+Signature signature_of(const Value* header) {
+    Value* name = header->val.list.values[0];
+    if (name->val.call_version == SIGNATURE_VERSION) {
+        return name->val.signature;
+    }
 
-                    value_deref(rest);
-                    i++;
-                } else {
-                    Value* eval_result =
-                        internal_eval(v->val.list.values[i], e);
-                    env_put(&funcall_env, name_args.values[i]->val.string,
-                            eval_result);
+    List params = header->val.list;
+    Signature ret = {0};
 
-                    value_deref(eval_result);
-                }
-            }
+    for (size_t i = 1; i < params.len; i++) {
+        assert(value_tag(params.values[i]) == SYMBOL);
+        Symbol* param = params.values[i]->val.symbol;
 
-            if (!rest && procedure->val.list.values[0]->val.list.len !=
-                             v->val.list.len) {
+        if (param == &symbol_rest) {
+            if (i + 2 != params.len) {
                 fprintf(stderr,
-                        "error: attempting to call %s with %zu arguments, "
-                        "expects %zu\n",
-                        v->val.list.values[0]->val.string, v->val.list.len - 1,
-                        procedure->val.list.values[0]->val.list.len - 1);
-                assert(procedure->val.list.values[0]->val.list.len ==
-                       v->val.list.len);
+                        "error: %s needs exactly one name after &rest\n",
+                        name->val.symbol->name);
+                assert(i + 2 == params.len);
             }
 
-            // All procedure arguments are now bound, recursive call into eval
-            // with the new environment
-            ret_val = internal_eval(func_body, &funcall_env);
-            env_deinit(&funcall_env);
+            ret.rest = true;
+            param = params.values[++i]->val.symbol;
+        } else {
+            ret.required++;
         }
 
-        value_deref(procedure);
+        // Frames are bound without looking for an earlier binding
+        for (size_t j = 1; j < i; j++) {
+            if (params.values[j]->val.symbol == param) {
+                fprintf(stderr, "error: %s has more than one parameter %s\n",
+                        name->val.symbol->name, param->name);
+                assert(false);
+            }
+        }
+    }
 
-        assert(ret_val);
-        return ret_val;
-    } else if (v->tag == SYMBOL) {
-        return env_get(e, v->val.string);
-    } else if (v->tag == NUMBER || v->tag == STRING) {
-        value_ref((Value*)v);
-        return (Value*)v;
+    name->val.signature = ret;
+    name->val.call_version = SIGNATURE_VERSION;
+
+    return ret;
+}
+
+// The parameter bound in frame slot `slot` of a procedure with this header
+Symbol* signature_param(const Value* header, Signature sig, size_t slot) {
+    size_t i = slot < sig.required ? slot + 1 : slot + 2;
+    return header->val.list.values[i]->val.symbol;
+}
+
+// Fails a call passing `argc` arguments unless the signature takes that many
+void signature_check(const Value* header, Signature sig, size_t argc) {
+    if (argc == sig.required || (sig.rest && argc > sig.required)) {
+        return;
     }
 
-    return env_get(e, "nil");
+    fprintf(stderr,
+            "error: attempting to call %s with %zu arguments, expects %s%u\n",
+            header->val.list.values[0]->val.symbol->name, argc,
+            sig.rest ? "at least " : "", sig.required);
+    assert(false);
 }
 
-// Eval a procedure which takes 1 argument
-Value* eval(const Value* v, Env* e) {
-    assert(v->tag == LIST);
-    List l = v->val.list;
+void env_print(const Env* e) {
+    for (size_t i = 0; i < e->len; i++) {
+        printf("%10s --> ", e->keys[i]->name);
+        value_print(e->vals[i]);
+        printf("\n");
+    }
+}
 
-    assert(l.len == 1);
+Value* handle_if(const Value*, Env*);
+Value* handle_define(const Value*, Env*);
+Value* handle_and(const Value*, Env*);
+Value* handle_or(const Value*, Env*);
+Value* handle_progn(const Value*, Env*);
+Value* handle_cond(const Value*, Env*);
+const Value* if_tail(const Value*, Env*);
+const Value* progn_tail(const Value*, Env*);
+const Value* cond_tail(const Value*, Env*);
 
-    return internal_eval(l.values[0], e);
+Value* parse(Parser* input);
+Value* internal_eval(const Value* v, Env* e);
+
+// Forms evaluated by the tree walker plus instructions run by the VM, read by
+// the benchmarks
+size_t eval_steps = 0;
+
+// Calls profiled by the name they were made under, see `--profile`
+typedef struct ProfileEntry {
+    Symbol* name;
+    size_t calls;
+    double inclusive;
+    double exclusive;
+    size_t allocs;
+    // Activations of this entry on the profile stack. Only the outermost one
+    // adds to `inclusive`, so recursion isn't counted more than once.
+    size_t active;
+} ProfileEntry;
+
+typedef struct ProfileFrame {
+    // Index into the profiler's entries, which move when a new name grows them
+    size_t entry;
+    double start;
+    size_t allocs_start;
+    // Spent in calls profiled while this one was running
+    double children;
+    size_t children_allocs;
+} ProfileFrame;
+
+typedef struct Profiler {
+    bool enabled;
+
+    ProfileEntry* entries;
+    size_t entries_len;
+    size_t entries_cap;
+
+    ProfileFrame* stack;
+    size_t stack_len;
+    size_t stack_cap;
+} Profiler;
+
+Profiler global_profiler;
+
+double profile_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
 }
 
-// if takes 3 (4 including symbol if) arguments
-Value* handle_if(const Value* v, Env* e) {
+void profile_enter(Symbol* name) {
+    Profiler* p = &global_profiler;
+
+    if (!name->profile_slot) {
+        if (p->entries_len == p->entries_cap) {
+            p->entries_cap = p->entries_cap ? p->entries_cap * 2 : 64;
+            p->entries =
+                realloc(p->entries, p->entries_cap * sizeof(ProfileEntry));
+        }
+
+        p->entries[p->entries_len++] = (ProfileEntry){.name = name};
+        name->profile_slot = p->entries_len;
+    }
+
+    if (p->stack_len == p->stack_cap) {
+        p->stack_cap = p->stack_cap ? p->stack_cap * 2 : 64;
+        p->stack = realloc(p->stack, p->stack_cap * sizeof(ProfileFrame));
+    }
+
+    ProfileEntry* entry = &p->entries[name->profile_slot - 1];
+    entry->calls++;
+    entry->active++;
+
+    p->stack[p->stack_len++] =
+        (ProfileFrame){.entry = name->profile_slot - 1,
+                       .start = profile_now(),
+                       .allocs_start = global_vp.allocs};
+}
+
+void profile_exit() {
+    Profiler* p = &global_profiler;
+    assert(p->stack_len > 0);
+
+    ProfileFrame* f = &p->stack[--p->stack_len];
+    double elapsed = profile_now() - f->start;
+    size_t allocs = global_vp.allocs - f->allocs_start;
+
+    ProfileEntry* entry = &p->entries[f->entry];
+    entry->exclusive += elapsed - f->children;
+    entry->allocs += allocs - f->children_allocs;
+    if (--entry->active == 0) {
+        entry->inclusive += elapsed;
+    }
+
+    if (p->stack_len > 0) {
+        p->stack[p->stack_len - 1].children += elapsed;
+        p->stack[p->stack_len - 1].children_allocs += allocs;
+    }
+}
+
+int profile_entry_compare(const void* a, const void* b) {
+    double lhs = ((const ProfileEntry*)a)->exclusive;
+    double rhs = ((const ProfileEntry*)b)->exclusive;
+
+    return (lhs < rhs) - (lhs > rhs);
+}
+
+// Prints every entry, the most exclusive time first
+void profile_report(FILE* out) {
+    Profiler* p = &global_profiler;
+
+    for (size_t i = 0; i < p->entries_len; i++) {
+        p->entries[i].name->profile_slot = 0;
+    }
+    qsort(p->entries, p->entries_len, sizeof(ProfileEntry),
+          profile_entry_compare);
+
+    fprintf(out, "%-24s %10s %12s %12s %10s\n", "name", "calls", "incl ms",
+            "excl ms", "allocs");
+    for (size_t i = 0; i < p->entries_len; i++) {
+        ProfileEntry* entry = &p->entries[i];
+        fprintf(out, "%-24s %10zu %12.3f %12.3f %10zu\n", entry->name->name,
+                entry->calls, entry->inclusive * 1000, entry->exclusive * 1000,
+                entry->allocs);
+    }
+}
+
+void profiler_deinit(Profiler* p) {
+    for (size_t i = 0; i < p->entries_len; i++) {
+        p->entries[i].name->profile_slot = 0;
+    }
+
+    free(p->entries);
+    free(p->stack);
+
+    *p = (Profiler){0};
+}
+
+// The name a call is profiled under, procedures and macros carry their own in
+// their `(name args...)` header, builtins go by the name they were called as
+Symbol* profile_name(const Value* procedure, const Value* call) {
+    if (value_tag(procedure) == PROCEDURE || value_tag(procedure) == MACRO) {
+        return procedure->val.list.values[0]->val.list.values[0]->val.symbol;
+    }
+
+    const Value* head = call->val.list.values[0];
+    if (value_tag(head) == SYMBOL) {
+        return head->val.symbol;
+    }
+
+    return &symbol_type_builtin;
+}
+
+// Spans of evaluation written as Chrome trace events, see `--trace`. The
+// evaluator only formats a span and copies it into a single producer, single
+// consumer ring; a flusher thread drains the ring into the file, so the run
+// being traced never waits on I/O. Spans that find the ring full are dropped
+// and counted rather than blocking.
+#define TRACE_RING_SIZE ((size_t)1 << 16)
+#define TRACE_LABEL_SIZE 80
+
+typedef struct TraceEvent {
+    const char* name;
+    // Nanoseconds since the trace started
+    uint64_t ts;
+    uint64_t dur;
+    // The form being evaluated, as source text and cut short if need be
+    char label[TRACE_LABEL_SIZE];
+} TraceEvent;
+
+typedef struct Tracer {
+    bool enabled;
+    FILE* out;
+    uint64_t epoch;
+
+    // Spans begun but not yet ended, only touched by the evaluator
+    TraceEvent* stack;
+    size_t stack_len;
+    size_t stack_cap;
+
+    // The evaluator advances `head`, the flusher advances `tail`
+    TraceEvent* ring;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    atomic_bool stop;
+    size_t dropped;
+
+    pthread_t flusher;
+} Tracer;
+
+Tracer global_tracer;
+
+uint64_t trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// The flusher renders events by hand, `fprintf` of the timestamps alone
+// costs more than the evaluation being traced
+char* trace_put_string(char* out, const char* s) {
+    *out++ = '"';
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            *out++ = '\\';
+            *out++ = c;
+        } else if (c < 0x20) {
+            out += sprintf(out, "\\u%04x", c);
+        } else {
+            *out++ = c;
+        }
+    }
+    *out++ = '"';
+    return out;
+}
+
+// Nanoseconds as microseconds with three decimals, the unit of `ts`
+char* trace_put_micros(char* out, uint64_t ns) {
+    char digits[24];
+    size_t n = 0;
+    uint64_t us = ns / 1000;
+    do {
+        digits[n++] = '0' + us % 10;
+        us /= 10;
+    } while (us);
+    while (n) {
+        *out++ = digits[--n];
+    }
+
+    uint64_t frac = ns % 1000;
+    *out++ = '.';
+    *out++ = '0' + frac / 100;
+    *out++ = '0' + frac / 10 % 10;
+    *out++ = '0' + frac % 10;
+    return out;
+}
+
+char* trace_put(char* out, const char* s) {
+    size_t n = strlen(s);
+    memcpy(out, s, n);
+    return out + n;
+}
+
+void* trace_flush(void* arg) {
+    Tracer* t = arg;
+    bool first = true;
+    // Fits the longest event, a label escaped entirely as \u sequences
+    char line[6 * TRACE_LABEL_SIZE + 256];
+
+    while (true) {
+        size_t tail = atomic_load_explicit(&t->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&t->head, memory_order_acquire);
+
+        if (tail == head) {
+            // Checking `stop` first means anything pushed before it was set
+            // is seen by the next look at `head`
+            if (atomic_load(&t->stop) &&
+                atomic_load_explicit(&t->head, memory_order_acquire) == tail) {
+                break;
+            }
+
+            nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            const TraceEvent* event = &t->ring[tail & (TRACE_RING_SIZE - 1)];
+
+            char* out = trace_put(line, first ? "\n" : ",\n");
+            out = trace_put(out, "{\"name\": ");
+            out = trace_put_string(out, event->name);
+            out = trace_put(out, ", \"ph\": \"X\", \"ts\": ");
+            out = trace_put_micros(out, event->ts);
+            out = trace_put(out, ", \"dur\": ");
+            out = trace_put_micros(out, event->dur);
+            out = trace_put(out, ", \"pid\": 1, \"tid\": 1, ");
+            out = trace_put(out, "\"args\": {\"form\": ");
+            out = trace_put_string(out, event->label);
+            out = trace_put(out, "}}");
+            fwrite(line, 1, out - line, t->out);
+            first = false;
+        }
+
+        atomic_store_explicit(&t->tail, tail, memory_order_release);
+    }
+
+    return NULL;
+}
+
+void tracer_start(Tracer* t, FILE* out) {
+    *t = (Tracer){.enabled = true, .out = out, .epoch = trace_now()};
+    t->ring = malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+
+    fprintf(out, "{\"traceEvents\": [");
+    pthread_create(&t->flusher, NULL, trace_flush, t);
+}
+
+void tracer_stop(Tracer* t) {
+    atomic_store(&t->stop, true);
+    pthread_join(t->flusher, NULL);
+
+    fprintf(t->out,
+            "\n], \"displayTimeUnit\": \"ms\", "
+            "\"otherData\": {\"dropped\": \"%zu\"}}\n",
+            t->dropped);
+    fclose(t->out);
+
+    free(t->stack);
+    free(t->ring);
+    *t = (Tracer){0};
+}
+
+void trace_begin(const char* name, const Value* form) {
+    Tracer* t = &global_tracer;
+
+    if (t->stack_len == t->stack_cap) {
+        t->stack_cap = t->stack_cap ? t->stack_cap * 2 : 64;
+        t->stack = realloc(t->stack, t->stack_cap * sizeof(TraceEvent));
+    }
+
+    TraceEvent* event = &t->stack[t->stack_len++];
+    event->name = name;
+    event->label[0] = '\0';
+    value_format(event->label, TRACE_LABEL_SIZE, 0, form);
+    event->ts = trace_now() - t->epoch;
+}
+
+void trace_end() {
+    Tracer* t = &global_tracer;
+    assert(t->stack_len > 0);
+
+    TraceEvent* event = &t->stack[--t->stack_len];
+    event->dur = trace_now() - t->epoch - event->ts;
+
+    size_t head = atomic_load_explicit(&t->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&t->tail, memory_order_acquire);
+    if (head - tail == TRACE_RING_SIZE) {
+        t->dropped++;
+        return;
+    }
+
+    t->ring[head & (TRACE_RING_SIZE - 1)] = *event;
+    atomic_store_explicit(&t->head, head + 1, memory_order_release);
+}
+
+// Set while calls are profiled or traced, otherwise the hooks in
+// `internal_eval` and `vm_run` cost a single branch
+bool call_hooks = false;
+
+void call_enter(const Value* procedure, const Value* call) {
+    Symbol* name = profile_name(procedure, call);
+
+    if (global_profiler.enabled) {
+        profile_enter(name);
+    }
+    if (global_tracer.enabled) {
+        trace_begin(name->name, call);
+    }
+}
+
+void call_exit() {
+    if (global_tracer.enabled) {
+        trace_end();
+    }
+    if (global_profiler.enabled) {
+        profile_exit();
+    }
+}
+
+// Arguments past this many are passed to a builtin in a heap array
+#define BUILTIN_STACK_ARGS 8
+
+// Calls a builtin with `argc` already evaluated arguments, dropping the
+// caller's references to them afterwards. Builtins still taking a list get one
+// built from `argv`, wrapped in a `Value` on the C stack; builtins that keep
+// the arguments share the list's store instead.
+Value* builtin_call(const Value* builtin, size_t argc, Value** argv, Env* e) {
+    Value* ret;
+
+    if (builtin->val.builtin_argv) {
+        ret = builtin->val.builtin_argv(argc, argv, e);
+    } else {
+        List args = list_init_slack(0, argc);
+        for (size_t i = 0; i < argc; i++) {
+            list_add(&args, argv[i], true);
+        }
+
+        Value builtin_args = {.tag = LIST, .val.list = args, .rc = 1};
+        ret = builtin->val.builtin(&builtin_args, e);
+        assert(builtin_args.rc == 1);
+
+        list_deinit(&args);
+    }
+
+    for (size_t i = 0; i < argc; i++) {
+        value_deref(argv[i]);
+    }
+
+    return ret;
+}
+
+// Binds a macro's arguments unevaluated and runs its body, returning the form
+// the call site `v` expands to
+Value* macro_expand(const Value* macro, const Value* v, Env* e) {
+    Value* arguments = internal_cdr(v->val.list);
+    Value* macro_arg_names = macro->val.list.values[0];
+    List macro_arg_names_list = macro_arg_names->val.list;
+    Value* macro_body = macro->val.list.values[1];
+
+    Env macrocall_env = env_init(macro_arg_names_list.len - 1, e);
+
+    for (size_t i = 1; i < macro_arg_names_list.len; i++) {
+        env_put(&macrocall_env, macro_arg_names_list.values[i]->val.symbol,
+                arguments->val.list.values[i - 1]);
+    }
+    value_deref(arguments);
+
+    Value* macro_eval = internal_eval(macro_body, &macrocall_env);
+    env_deinit(&macrocall_env);
+
+    return macro_eval;
+}
+
+// Replaces every macro call in `form` with its expansion, so a macro runs once
+// when its call site is defined rather than each time it is evaluated. Quoted
+// data, macro definitions, procedure definitions (which handle_define expands
+// with their own parameters) and calls through a symbol that is one of
+// `params` are left alone. Returns a new reference to the expanded form, which
+// is `form` itself unless it was a macro call.
+Value* macro_expand_all(Value* form, List params, Env* e) {
+    value_ref(form);
+
+    if (value_quoted(form) || value_tag(form) != LIST ||
+        form->val.list.len == 0) {
+        return form;
+    }
+
+    Value* head = form->val.list.values[0];
+    size_t first = 0;
+
+    if (value_tag(head) == SYMBOL && !value_quoted(head)) {
+        Symbol* symbol = head->val.symbol;
+
+        if (symbol == &symbol_define_macro || symbol == &symbol_quasiquote) {
+            // Macro bodies and templates are data until they're evaluated
+            return form;
+        } else if (symbol == &symbol_define && form->val.list.len > 1 &&
+                   value_tag(form->val.list.values[1]) == LIST) {
+            // handle_define expands a procedure's body itself, where it knows
+            // which heads are parameters
+            return form;
+        } else if (symbol == &symbol_define) {
+            // Skip the name being defined
+            first = 2;
+        }
+
+        bool shadowed = false;
+        for (size_t i = 1; i < params.len; i++) {
+            shadowed |= params.values[i]->val.symbol == symbol;
+        }
+
+        Value* bound = shadowed ? VALUE_NIL : env_get(e, symbol);
+        if (value_tag(bound) == MACRO) {
+            Value* expansion = macro_expand(bound, form, e);
+            value_deref(bound);
+            value_deref(form);
+
+            Value* ret = macro_expand_all(expansion, params, e);
+            value_deref(expansion);
+
+            return ret;
+        }
+        value_deref(bound);
+    }
+
+    for (size_t i = first; i < form->val.list.len; i++) {
+        Value* child = form->val.list.values[i];
+        Value* expanded = macro_expand_all(child, params, e);
+
+        if (expanded != child) {
+            list_set(&form->val.list, i, expanded);
+        } else {
+            value_deref(expanded);
+        }
+    }
+
+    return form;
+}
+
+// TODO I think we're going to need a similar internal_eval and eval split as we
+// needed with car and cdr
+// The issue is I want to call with a list from my C code, but from the lisp
+// code it makes more sense to call with a list of args where eval expects a
+// single arg
+//
+// Calls in tail position (the branches of if and cond, the last form of progn,
+// a procedure body, a macro expansion) don't recurse, `v` is replaced and the
+// loop continues. A tail call whose callee binds every name the current call
+// frame does swaps that frame for the callee's, so a self tail recursive loop
+// runs in constant C stack and env memory. Any other tail call keeps the frame,
+// which the callee can still see through dynamic scope, and recurses.
+Value* internal_eval(const Value* v, Env* e) {
+    // The call frame this invocation created, if any
+    Env frame;
+    bool owns_frame = false;
+    // Keeps `v` alive when it points into a procedure or macro expansion
+    Value* owner = NULL;
+    Value* ret_val = NULL;
+    // Set while the procedure running in `frame` is being profiled or traced
+    bool hooked = false;
+
+    while (!ret_val) {
+        eval_steps++;
+
+        if (value_quoted(v)) {
+            ret_val = value_unquote(v);
+        } else if (value_tag(v) == LIST) {
+            Value* procedure = env_get_operator(e, v->val.list.values[0]);
+            if (!procedure) {
+                procedure = internal_eval(v->val.list.values[0], e);
+            }
+            const Value* tail = NULL;
+            Value* tail_owner = NULL;
+
+            if (value_tag(procedure) == SPECIAL_FORM) {
+                builtin_procedure handler = procedure->val.builtin;
+
+                // A traced if, cond or progn spans picking its tail form, not
+                // evaluating it
+                if (global_tracer.enabled) {
+                    trace_begin(profile_name(procedure, v)->name, v);
+                }
+
+                // Special forms evaluate their own arguments
+                if (handler == handle_if) {
+                    tail = if_tail(v, e);
+                } else if (handler == handle_cond) {
+                    tail = cond_tail(v, e);
+                } else if (handler == handle_progn) {
+                    tail = progn_tail(v, e);
+                } else {
+                    ret_val = handler(v, e);
+                }
+
+                if (global_tracer.enabled) {
+                    trace_end();
+                }
+            } else if (value_tag(procedure) == MACRO) {
+                if (call_hooks) {
+                    call_enter(procedure, v);
+                }
+
+                tail_owner = macro_expand(procedure, v, e);
+                tail = tail_owner;
+
+                if (call_hooks) {
+                    call_exit();
+                }
+            } else if (value_tag(procedure) == BUILTIN) {
+                // Now evaluate all of the arguments to prepare them for the
+                // builtin, on the C stack unless there are a lot of them
+                size_t argc = v->val.list.len - 1;
+                Value* stack_argv[BUILTIN_STACK_ARGS];
+                Value** argv = argc <= BUILTIN_STACK_ARGS
+                                   ? stack_argv
+                                   : malloc(argc * sizeof(*argv));
+                for (size_t i = 0; i < argc; i++) {
+                    argv[i] = internal_eval(v->val.list.values[i + 1], e);
+                }
+
+                if (call_hooks) {
+                    call_enter(procedure, v);
+                    ret_val = builtin_call(procedure, argc, argv, e);
+                    call_exit();
+                } else {
+                    ret_val = builtin_call(procedure, argc, argv, e);
+                }
+
+                if (argv != stack_argv) {
+                    free(argv);
+                }
+            } else if (value_tag(procedure) == PROCEDURE) {
+                assert(value_tag(procedure->val.list.values[0]) == LIST);
+                assert(value_tag(procedure->val.list.values[1]) == LIST ||
+                       value_tag(procedure->val.list.values[1]) == SYMBOL);
+
+                const Value* header = procedure->val.list.values[0];
+                Signature sig = signature_of(header);
+                size_t argc = v->val.list.len - 1;
+                signature_check(header, sig, argc);
+
+                Env funcall_env = env_init(sig.required + sig.rest, e);
+
+                // Bind the provided arguments into their slots of the
+                // funcall_env, evaluated in the caller's env
+                for (size_t i = 0; i < sig.required; i++) {
+                    env_bind(&funcall_env, signature_param(header, sig, i),
+                             internal_eval(v->val.list.values[i + 1], e));
+                }
+
+                if (sig.rest) {
+                    // Map all remaining arguments into a list
+                    List rest_args = list_init_slack(0, argc - sig.required);
+                    for (size_t i = sig.required; i < argc; i++) {
+                        list_add(&rest_args,
+                                 internal_eval(v->val.list.values[i + 1], e),
+                                 false);
+                    }
+
+                    Value* rest = valuepool_alloc(&global_vp);
+                    rest->tag = LIST;
+                    rest->val.list = rest_args;
+
+                    env_bind(&funcall_env,
+                             signature_param(header, sig, sig.required), rest);
+                }
+
+                // All procedure arguments are now bound. A tail call replaces
+                // this invocation's frame only when the callee shadows all of
+                // it, otherwise the body gets an invocation of its own.
+                if (owns_frame && !env_shadows(&funcall_env, &frame)) {
+                    if (call_hooks) {
+                        call_enter(procedure, v);
+                    }
+
+                    ret_val = internal_eval(procedure->val.list.values[1],
+                                            &funcall_env);
+
+                    if (call_hooks) {
+                        call_exit();
+                    }
+                    env_deinit(&funcall_env);
+                } else {
+                    if (owns_frame) {
+                        env_reparent(&funcall_env, frame.parent);
+                        env_deinit(&frame);
+                    }
+                    frame = funcall_env;
+                    owns_frame = true;
+                    e = &frame;
+
+                    // A tail call ends the hooked activation it replaces
+                    if (hooked) {
+                        call_exit();
+                    }
+                    hooked = call_hooks;
+                    if (hooked) {
+                        call_enter(procedure, v);
+                    }
+
+                    value_ref(procedure);
+                    tail_owner = procedure;
+                    tail = procedure->val.list.values[1];
+                }
+            } else {
+                fprintf(stderr, "error: attempting to call a non procedure\n");
+                assert(false);
+            }
+
+            value_deref(procedure);
+
+            if (tail) {
+                if (tail_owner) {
+                    if (owner) {
+                        value_deref(owner);
+                    }
+                    owner = tail_owner;
+                }
+
+                v = tail;
+            }
+        } else if (value_tag(v) == SYMBOL) {
+            ret_val = env_get_ref(e, v);
+        } else if (value_tag(v) == NUMBER || value_tag(v) == STRING) {
+            value_ref((Value*)v);
+            ret_val = (Value*)v;
+        } else {
+            ret_val = env_get(e, &symbol_nil);
+        }
+    }
+
+    if (hooked) {
+        call_exit();
+    }
+    if (owns_frame) {
+        env_deinit(&frame);
+    }
+    if (owner) {
+        value_deref(owner);
+    }
+
+    return ret_val;
+}
+
+Value* engine_eval(const Value* v, Env* e);
+
+// Eval a procedure which takes 1 argument
+Value* eval(size_t argc, Value** argv, Env* e) {
+    assert(argc == 1);
+
+    return engine_eval(argv[0], e);
+}
+
+// if takes 3 (4 including symbol if) arguments, returns the branch to evaluate
+const Value* if_tail(const Value* v, Env* e) {
     // (if condition true_expression false_expression)
-    assert(v->tag == LIST);
+    assert(value_tag(v) == LIST);
     List l = v->val.list;
 
     assert(l.len == 4);
-    assert(l.values[0]->tag == SYMBOL &&
-           !strcmp("if", l.values[0]->val.string));
+    assert(value_tag(l.values[0]) == SYMBOL &&
+           l.values[0]->val.symbol == &symbol_if);
 
     // False only if nil, 0, "", false, f
     Value* condition = internal_eval(l.values[1], e);
@@ -663,19 +2496,19 @@ Value* handle_if(const Value* v, Env* e) {
 
     value_deref(condition);
 
-    if (truthy) {
-        return internal_eval(l.values[2], e);
-    } else {
-        return internal_eval(l.values[3], e);
-    }
+    return truthy ? l.values[2] : l.values[3];
+}
+
+Value* handle_if(const Value* v, Env* e) {
+    return internal_eval(if_tail(v, e), e);
 }
 
 Value* handle_and(const Value* v, Env* e) {
-    assert(v->tag == LIST);
+    assert(value_tag(v) == LIST);
     List l = v->val.list;
 
-    assert(l.values[0]->tag == SYMBOL &&
-           !strcmp("and", l.values[0]->val.string));
+    assert(value_tag(l.values[0]) == SYMBOL &&
+           l.values[0]->val.symbol == &symbol_and);
     assert(l.len > 1);
 
     for (size_t i = 1; i < l.len; i++) {
@@ -684,19 +2517,19 @@ Value* handle_and(const Value* v, Env* e) {
         value_deref(result);
 
         if (!truthy) {
-            return env_get(e, "f");
+            return env_get(e, &symbol_f);
         }
     }
 
-    return env_get(e, "t");
+    return env_get(e, &symbol_t);
 }
 
 Value* handle_or(const Value* v, Env* e) {
-    assert(v->tag == LIST);
+    assert(value_tag(v) == LIST);
     List l = v->val.list;
 
-    assert(l.values[0]->tag == SYMBOL &&
-           !strcmp("or", l.values[0]->val.string));
+    assert(value_tag(l.values[0]) == SYMBOL &&
+           l.values[0]->val.symbol == &symbol_or);
     assert(l.len > 1);
 
     for (size_t i = 1; i < l.len; i++) {
@@ -705,17 +2538,51 @@ Value* handle_or(const Value* v, Env* e) {
         value_deref(result);
 
         if (truthy) {
-            return env_get(e, "t");
+            return env_get(e, &symbol_t);
         }
     }
 
-    return env_get(e, "f");
+    return env_get(e, &symbol_f);
+}
+
+// Annotates every evaluated symbol in a procedure body with its slot in the
+// procedure's call frame, which holds its parameters in order. Call frames are
+// chained to the caller's env (dynamic scope), so only a procedure's own
+// parameters have a fixed address. Any other symbol keeps slot -1 and is
+// looked up by name.
+void resolve_locals(Value* body, List params) {
+    if (value_quoted(body)) {
+        // Quoted data is never evaluated as a reference
+        return;
+    }
+
+    if (value_tag(body) == SYMBOL) {
+        body->val.slot = -1;
+
+        int slot = 0;
+        for (size_t i = 1; i < params.len; i++) {
+            if (params.values[i]->val.symbol == &symbol_rest) {
+                continue;
+            }
+
+            if (params.values[i]->val.symbol == body->val.symbol) {
+                body->val.slot = slot;
+                break;
+            }
+
+            slot++;
+        }
+    } else if (value_tag(body) == LIST) {
+        for (size_t i = 0; i < body->val.list.len; i++) {
+            resolve_locals(body->val.list.values[i], params);
+        }
+    }
 }
 
 Value handle_lambda(Parser* input) { return (Value){}; }
 Value handle_let(Parser* input) { return (Value){}; }
 Value* handle_define(const Value* v, Env* e) {
-    assert(v->tag == LIST);
+    assert(value_tag(v) == LIST);
     List l = v->val.list;
     assert(l.len == 3);
 
@@ -723,25 +2590,33 @@ Value* handle_define(const Value* v, Env* e) {
     // (define (name [arg1 [arg2 …]]) body …)
     // Regular variable definition form
     // (define name expr)
-    assert(l.values[0]->tag == SYMBOL &&
-           !strcmp("define", l.values[0]->val.string));
+    assert(value_tag(l.values[0]) == SYMBOL &&
+           l.values[0]->val.symbol == &symbol_define);
 
-    if (l.values[1]->tag == SYMBOL) {
+    if (value_tag(l.values[1]) == SYMBOL) {
         // Regular path
-        assert(l.values[1]->tag == SYMBOL);
+        assert(value_tag(l.values[1]) == SYMBOL);
 
         Value* expr = internal_eval(l.values[2], e);
 
-        env_put(e, l.values[1]->val.string, expr);
+        env_put(e, l.values[1]->val.symbol, expr);
 
         return expr;
-    } else if (l.values[1]->tag == LIST) {
+    } else if (value_tag(l.values[1]) == LIST) {
         // Procedure path
-        assert(l.values[1]->tag == LIST);
-        assert(l.values[2]->tag == LIST || l.values[2]->tag == SYMBOL);
+        assert(value_tag(l.values[1]) == LIST);
+        assert(value_tag(l.values[2]) == LIST ||
+               value_tag(l.values[2]) == SYMBOL);
 
         List name_vars = l.values[1]->val.list;
-        assert(name_vars.values[0]->tag == SYMBOL);
+        assert(value_tag(name_vars.values[0]) == SYMBOL);
+
+        // Arity and parameter errors show up here rather than at a call
+        signature_of(l.values[1]);
+
+        // Expanded before resolving locals, expansions can mention parameters
+        Value* body = macro_expand_all(l.values[2], name_vars, e);
+        resolve_locals(body, name_vars);
 
         // Procedures are stored as `Value`s, with the `List` field being
         // populated as follows
@@ -749,13 +2624,13 @@ Value* handle_define(const Value* v, Env* e) {
 
         List procedure_list = list_init();
         list_add(&procedure_list, l.values[1], true);
-        list_add(&procedure_list, l.values[2], true);
+        list_add(&procedure_list, body, false);
 
         Value* procedure = valuepool_alloc(&global_vp);
         procedure->tag = PROCEDURE;
         procedure->val.list = procedure_list;
 
-        env_put(e, name_vars.values[0]->val.string, procedure);
+        env_put(e, name_vars.values[0]->val.symbol, procedure);
 
         return procedure;
     }
@@ -764,20 +2639,20 @@ Value* handle_define(const Value* v, Env* e) {
 }
 
 Value* handle_define_macro(const Value* v, Env* e) {
-    assert(v->tag == LIST);
+    assert(value_tag(v) == LIST);
     List l = v->val.list;
     assert(l.len == 3);
 
-    assert(l.values[0]->tag == SYMBOL &&
-           !strcmp("define-macro", l.values[0]->val.string));
-    assert(l.values[1]->tag == LIST);
-    assert(l.values[1]->tag == LIST);
+    assert(value_tag(l.values[0]) == SYMBOL &&
+           l.values[0]->val.symbol == &symbol_define_macro);
+    assert(value_tag(l.values[1]) == LIST);
+    assert(value_tag(l.values[1]) == LIST);
 
-    assert(l.values[1]->tag == LIST);
-    assert(l.values[2]->tag == LIST || l.values[2]->tag == SYMBOL);
+    assert(value_tag(l.values[1]) == LIST);
+    assert(value_tag(l.values[2]) == LIST || value_tag(l.values[2]) == SYMBOL);
 
     List name_vars = l.values[1]->val.list;
-    assert(name_vars.values[0]->tag == SYMBOL);
+    assert(value_tag(name_vars.values[0]) == SYMBOL);
 
     List macro_list = list_init();
     list_add(&macro_list, l.values[1], true);
@@ -787,17 +2662,18 @@ Value* handle_define_macro(const Value* v, Env* e) {
     macro->tag = MACRO;
     macro->val.list = macro_list;
 
-    env_put(e, name_vars.values[0]->val.string, macro);
+    env_put(e, name_vars.values[0]->val.symbol, macro);
 
     return macro;
 }
 
-Value* handle_progn(const Value* v, Env* e) {
-    assert(v->tag == LIST);
+// Evaluates all but the last form, which is returned
+const Value* progn_tail(const Value* v, Env* e) {
+    assert(value_tag(v) == LIST);
     List l = v->val.list;
 
-    assert(l.values[0]->tag == SYMBOL &&
-           !strcmp("progn", l.values[0]->val.string));
+    assert(value_tag(l.values[0]) == SYMBOL &&
+           l.values[0]->val.symbol == &symbol_progn);
     assert(l.len > 1);
 
     for (size_t i = 1; i < l.len - 1; i++) {
@@ -805,39 +2681,40 @@ Value* handle_progn(const Value* v, Env* e) {
         value_deref(result);
     }
 
-    Value* result = internal_eval(l.values[l.len - 1], e);
-    return result;
+    return l.values[l.len - 1];
+}
+
+Value* handle_progn(const Value* v, Env* e) {
+    return internal_eval(progn_tail(v, e), e);
 }
 
 // Display takes 1 argument
 // (display arg1)
-Value* handle_display(const Value* v, Env* _) {
-    assert(v->tag == LIST);
-    List l = v->val.list;
+Value* handle_display(size_t argc, Value** argv, Env* _) {
+    assert(argc == 1);
 
-    assert(l.len == 1);
-
-    value_print(l.values[0]);
+    value_print(argv[0]);
     printf("\n");
 
-    value_ref(l.values[0]);
-    return l.values[0];
+    value_ref(argv[0]);
+    return argv[0];
 }
 
-Value* handle_cond(const Value* v, Env* e) {
+// Returns the expression of the first case whose condition holds
+const Value* cond_tail(const Value* v, Env* e) {
     // (case
     //   ((> x 1) 42)
     //   ((> x -4) 41)
     //   (t default))
-    assert(v->tag == LIST);
+    assert(value_tag(v) == LIST);
     List l = v->val.list;
 
-    assert(l.values[0]->tag == SYMBOL &&
-           !strcmp("cond", l.values[0]->val.string));
+    assert(value_tag(l.values[0]) == SYMBOL &&
+           l.values[0]->val.symbol == &symbol_cond);
     assert(l.len > 1);
 
     for (size_t i = 1; i < l.len; i++) {
-        assert(l.values[i]->tag == LIST);
+        assert(value_tag(l.values[i]) == LIST);
         List case_list = l.values[i]->val.list;
 
         assert(case_list.len == 2);
@@ -847,532 +2724,1752 @@ Value* handle_cond(const Value* v, Env* e) {
         value_deref(boolean_result);
 
         if (truthy) {
-            return internal_eval(case_list.values[1], e);
+            return case_list.values[1];
         }
     }
 
-    return env_get(e, "nil");
+    return VALUE_NIL;
 }
 
-typedef enum BinOp {
-    ADD,
-    SUB,
-    MUL,
-    DIV,
-    MOD,
-} BinOp;
-Value* handle_arithmetic(const Value* v, BinOp op) {
-    assert(v->tag == LIST);
-    List l = v->val.list;
-    assert(l.len >= 1);
+Value* handle_cond(const Value* v, Env* e) {
+    return internal_eval(cond_tail(v, e), e);
+}
 
-    Value* first = l.values[0];
-    assert(first->tag == NUMBER);
+// Returns the operand of `template` if it is an (`symbol` x) form, quoted or
+// not
+const Value* quasiquote_operand(const Value* template, Symbol* symbol) {
+    if (value_tag(template) != LIST || template->val.list.len != 2) {
+        return NULL;
+    }
 
-    Value* accumulator = valuepool_alloc(&global_vp);
-    accumulator->tag = NUMBER;
-    accumulator->val.number = first->val.number;
+    const Value* head = template->val.list.values[0];
+    if (value_tag(head) != SYMBOL || value_quoted(head) ||
+        head->val.symbol != symbol) {
+        return NULL;
+    }
 
-    for (size_t i = 1; i < l.len; i++) {
-        Value* next = l.values[i];
-        assert(next->tag == NUMBER);
+    return template->val.list.values[1];
+}
+
+// Returns `v` with `quotes` more levels of quoting, taking over the caller's
+// reference. `v` is only copied when it's immediate or someone else holds it.
+Value* value_quote(Value* v, int quotes) {
+    if (quotes == 0) {
+        return v;
+    }
+
+    Value* ret = value_box(v);
+    if (ret == v && v->rc > 1) {
+        ret = value_clone_node(v);
+        if (value_has_list(v)) {
+            for (size_t i = 0; i < v->val.list.len; i++) {
+                list_add(&ret->val.list, v->val.list.values[i], true);
+            }
+        }
+        value_deref(v);
+    }
+
+    ret->quoted += quotes;
+    return ret;
+}
+
+// Builds the data a quasiquote template describes. Parts of the template
+// without unquotes are shared with it as is, and every list that does contain
+// one is allocated once at its final size. A quoted part such as ',x is filled
+// in like any other and keeps its quotes. `depth` counts the enclosing
+// quasiquotes, only unquotes at depth 1 are evaluated.
+Value* quasiquote_instantiate(const Value* template, Env* e, int depth) {
+    if (value_tag(template) != LIST) {
+        value_ref((Value*)template);
+        return (Value*)template;
+    }
+
+    const Value* operand = quasiquote_operand(template, &symbol_unquote);
+    if (operand && depth == 1) {
+        return value_quote(internal_eval(operand, e), value_quoted(template));
+    }
+
+    if (operand) {
+        depth--;
+    } else if (quasiquote_operand(template, &symbol_quasiquote)) {
+        depth++;
+    }
+
+    typedef struct Part {
+        Value* value;
+        bool splice;
+    } Part;
+
+    // Splices are evaluated first so the list can be sized up front
+    List template_list = template->val.list;
+    Part small_parts[8];
+    Part* parts = template_list.len <= 8
+                      ? small_parts
+                      : calloc(template_list.len, sizeof(Part));
+    size_t len = 0;
+    bool changed = false;
+
+    for (size_t i = 0; i < template_list.len; i++) {
+        const Value* element = template_list.values[i];
+        const Value* splice =
+            depth == 1 && !value_quoted(element)
+                ? quasiquote_operand(element, &symbol_unquote_splicing)
+                : NULL;
+
+        if (splice) {
+            parts[i] =
+                (Part){.value = internal_eval(splice, e), .splice = true};
+            // nil is the empty list, it splices in nothing
+            assert(value_tag(parts[i].value) == LIST ||
+                   value_tag(parts[i].value) == NIL);
+            if (value_tag(parts[i].value) == LIST) {
+                len += parts[i].value->val.list.len;
+            }
+            changed = true;
+        } else {
+            parts[i] =
+                (Part){.value = quasiquote_instantiate(element, e, depth),
+                       .splice = false};
+            len++;
+            changed |= parts[i].value != element;
+        }
+    }
+
+    Value* ret = (Value*)template;
+    if (changed) {
+        List l = list_init_slack(0, len);
+        for (size_t i = 0; i < template_list.len; i++) {
+            if (parts[i].splice && value_tag(parts[i].value) == NIL) {
+                continue;
+            } else if (parts[i].splice) {
+                List spliced = parts[i].value->val.list;
+                for (size_t j = 0; j < spliced.len; j++) {
+                    list_add(&l, spliced.values[j], true);
+                }
+            } else {
+                list_add(&l, parts[i].value, true);
+            }
+        }
+
+        ret = valuepool_alloc(&global_vp);
+        ret->tag = LIST;
+        ret->quoted = value_quoted(template);
+        ret->val.list = l;
+    } else {
+        value_ref(ret);
+    }
+
+    for (size_t i = 0; i < template_list.len; i++) {
+        value_deref(parts[i].value);
+    }
+    if (parts != small_parts) {
+        free(parts);
+    }
+
+    return ret;
+}
+
+// (quasiquote template)
+Value* handle_quasiquote(const Value* v, Env* e) {
+    assert(value_tag(v) == LIST);
+    List l = v->val.list;
+
+    assert(l.len == 2);
+
+    return quasiquote_instantiate(l.values[1], e, 1);
+}
+
+typedef enum BinOp {
+    ADD,
+    SUB,
+    MUL,
+    DIV,
+    MOD,
+} BinOp;
+Value* handle_arithmetic(size_t argc, Value** argv, BinOp op) {
+    assert(argc >= 1);
+
+    Value* first = argv[0];
+    assert(value_tag(first) == NUMBER);
+
+    double accumulator = value_number(first);
+
+    for (size_t i = 1; i < argc; i++) {
+        Value* next = argv[i];
+        assert(value_tag(next) == NUMBER);
 
         switch (op) {
         case ADD:
-            accumulator->val.number += next->val.number;
+            accumulator += value_number(next);
             break;
         case SUB:
-            accumulator->val.number -= next->val.number;
+            accumulator -= value_number(next);
             break;
         case MUL:
-            accumulator->val.number *= next->val.number;
+            accumulator *= value_number(next);
             break;
         case DIV:
-            accumulator->val.number /= next->val.number;
+            accumulator /= value_number(next);
             break;
         case MOD:
-            accumulator->val.number =
-                fmod(accumulator->val.number, next->val.number);
+            accumulator = fmod(accumulator, value_number(next));
             break;
         }
     }
 
-    return accumulator;
+    return value_from_number(accumulator);
+}
+
+Value* handle_add(size_t argc, Value** argv, Env* _) {
+    return handle_arithmetic(argc, argv, ADD);
+}
+Value* handle_sub(size_t argc, Value** argv, Env* _) {
+    return handle_arithmetic(argc, argv, SUB);
+}
+Value* handle_mul(size_t argc, Value** argv, Env* _) {
+    return handle_arithmetic(argc, argv, MUL);
+}
+Value* handle_div(size_t argc, Value** argv, Env* _) {
+    return handle_arithmetic(argc, argv, DIV);
+}
+Value* handle_mod(size_t argc, Value** argv, Env* _) {
+    return handle_arithmetic(argc, argv, MOD);
+}
+
+typedef enum CompOp {
+    LT,
+    GT,
+    EQ,
+    LE,
+    GE,
+    NE,
+} CompOp;
+Value* handle_logical(size_t argc, Value** argv, const Env* e, CompOp op) {
+    assert(argc == 2);
+
+    Value* first = argv[0];
+    Value* second = argv[1];
+    if (value_tag(first) == NUMBER && value_tag(second) == NUMBER) {
+        assert(value_tag(first) == NUMBER);
+        assert(value_tag(second) == NUMBER);
+
+        bool result;
+
+        switch (op) {
+        case LT:
+            result = value_number(first) < value_number(second);
+            break;
+        case GT:
+            result = value_number(first) > value_number(second);
+            break;
+        case EQ:
+            result = value_number(first) == value_number(second);
+            break;
+        case LE:
+            result = value_number(first) <= value_number(second);
+            break;
+        case GE:
+            result = value_number(first) >= value_number(second);
+            break;
+        case NE:
+            result = value_number(first) != value_number(second);
+            break;
+        }
+
+        return env_get(e, result ? &symbol_t : &symbol_f);
+    } else if (value_tag(first) == BOOLEAN && value_tag(second) == BOOLEAN) {
+        assert(op == EQ || op == NE);
+
+        bool result;
+
+        switch (op) {
+        case EQ:
+            result = value_boolean(first) == value_boolean(second);
+            break;
+        case NE:
+            result = value_boolean(first) != value_boolean(second);
+            break;
+        default:
+            assert(false);
+        }
+
+        return env_get(e, result ? &symbol_t : &symbol_f);
+    }
+
+    assert(false);
+}
+
+Value* handle_lt(size_t argc, Value** argv, Env* e) {
+    return handle_logical(argc, argv, e, LT);
+}
+Value* handle_gt(size_t argc, Value** argv, Env* e) {
+    return handle_logical(argc, argv, e, GT);
+}
+Value* handle_eq(size_t argc, Value** argv, Env* e) {
+    return handle_logical(argc, argv, e, EQ);
+}
+Value* handle_le(size_t argc, Value** argv, Env* e) {
+    return handle_logical(argc, argv, e, LE);
+}
+Value* handle_ge(size_t argc, Value** argv, Env* e) {
+    return handle_logical(argc, argv, e, GE);
+}
+Value* handle_ne(size_t argc, Value** argv, Env* e) {
+    return handle_logical(argc, argv, e, NE);
+}
+
+Value* builtin_tagp(size_t argc, Value** argv, ValueTag tag) {
+    assert(argc == 1);
+
+    return value_from_boolean(value_tag(argv[0]) == tag);
+}
+
+Value* builtin_nilp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, NIL);
+}
+Value* builtin_numberp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, NUMBER);
+}
+Value* builtin_stringp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, STRING);
+}
+Value* builtin_booleanp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, BOOLEAN);
+}
+Value* builtin_procedurep(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, PROCEDURE);
+}
+Value* builtin_specialformp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, SPECIAL_FORM);
+}
+Value* builtin_builtinp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, BUILTIN);
+}
+Value* builtin_symbolp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, SYMBOL);
+}
+Value* builtin_listp(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, LIST);
+}
+Value* builtin_macrop(size_t argc, Value** argv, Env* _) {
+    return builtin_tagp(argc, argv, MACRO);
+}
+
+// Takes 1 arg
+Value* builtin_tag(size_t argc, Value** argv, Env* e) {
+    assert(argc == 1);
+
+    Value* inner = argv[0];
+
+    switch (value_tag(inner)) {
+    case NIL:
+        return env_get(e, &symbol_type_nil);
+    case NUMBER:
+        return env_get(e, &symbol_type_number);
+    case STRING:
+        return env_get(e, &symbol_type_string);
+    case BOOLEAN:
+        return env_get(e, &symbol_type_boolean);
+    case PROCEDURE:
+        return env_get(e, &symbol_type_procedure);
+    case SPECIAL_FORM:
+        return env_get(e, &symbol_type_specialform);
+    case BUILTIN:
+        return env_get(e, &symbol_type_builtin);
+    case SYMBOL:
+        return env_get(e, &symbol_type_symbol);
+    case LIST:
+        return env_get(e, &symbol_type_list);
+    case MACRO:
+        return env_get(e, &symbol_type_macro);
+    }
+}
+
+Symbol* value_tag_symbols[VALUE_TAGS] = {
+    [NIL] = &symbol_type_nil,
+    [NUMBER] = &symbol_type_number,
+    [STRING] = &symbol_type_string,
+    [BOOLEAN] = &symbol_type_boolean,
+    [PROCEDURE] = &symbol_type_procedure,
+    [SPECIAL_FORM] = &symbol_type_specialform,
+    [BUILTIN] = &symbol_type_builtin,
+    [SYMBOL] = &symbol_type_symbol,
+    [LIST] = &symbol_type_list,
+    [MACRO] = &symbol_type_macro,
+    [CONS] = &symbol_type_cons,
+};
+
+// A `(name)` list for the counts to be added to
+Value* runtime_stats_list(Symbol* name) {
+    Value* symbol = valuepool_alloc(&global_vp);
+    symbol->tag = SYMBOL;
+    symbol->val.symbol = name;
+    symbol->val.slot = -1;
+
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = LIST;
+    ret->val.list = list_init();
+    list_add(&ret->val.list, symbol, false);
+
+    return ret;
+}
+
+// A `(name count)` list
+Value* runtime_stats_entry(Symbol* name, size_t count) {
+    Value* ret = runtime_stats_list(name);
+    list_add(&ret->val.list, value_from_number(count), false);
+
+    return ret;
+}
+
+// Takes no args, returns
+// ((allocs (#tag n)...) (frees ...) (live ...) (clones ...)
+//  (list-reallocs n) (list-copies n) (env-frames n) (env-depth-peak n))
+// where only tags with a nonzero count are listed
+Value* builtin_runtime_stats(size_t argc, Value** argv, Env* _) {
+    assert(argc == 0);
+
+    // Counted before the result allocates anything
+    size_t live[VALUE_TAGS] = {0};
+    valuepool_count_live(&global_vp, live);
+    RuntimeStats stats = global_stats;
+
+    size_t allocs[VALUE_TAGS];
+    for (size_t tag = 0; tag < VALUE_TAGS; tag++) {
+        allocs[tag] = stats.frees[tag] + live[tag];
+    }
+
+    const char* names[] = {"allocs", "frees", "live", "clones"};
+    const size_t* counts[] = {allocs, stats.frees, live, stats.clones};
+
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = LIST;
+    ret->val.list = list_init();
+
+    for (size_t i = 0; i < 4; i++) {
+        Value* entry = runtime_stats_list(intern(names[i]));
+        for (size_t tag = 0; tag < VALUE_TAGS; tag++) {
+            if (counts[i][tag]) {
+                list_add(&entry->val.list,
+                         runtime_stats_entry(value_tag_symbols[tag],
+                                             counts[i][tag]),
+                         false);
+            }
+        }
+
+        list_add(&ret->val.list, entry, false);
+    }
+
+    list_add(&ret->val.list,
+             runtime_stats_entry(intern("list-reallocs"), stats.list_reallocs),
+             false);
+    list_add(&ret->val.list,
+             runtime_stats_entry(intern("list-copies"), stats.list_copies),
+             false);
+    list_add(&ret->val.list,
+             runtime_stats_entry(intern("env-frames"), stats.env_frames),
+             false);
+    list_add(&ret->val.list,
+             runtime_stats_entry(intern("env-depth-peak"),
+                                 stats.env_depth_peak),
+             false);
+
+    return ret;
+}
+
+// Writes the same counters as `(runtime-stats)`, a line per tag and counter
+void runtime_stats_write(FILE* out) {
+    size_t live[VALUE_TAGS] = {0};
+    valuepool_count_live(&global_vp, live);
+
+    fprintf(out, "%-16s %12s %12s %12s %12s\n", "tag", "allocs", "frees",
+            "live", "clones");
+    for (size_t tag = 0; tag < VALUE_TAGS; tag++) {
+        fprintf(out, "%-16s %12zu %12zu %12zu %12zu\n",
+                value_tag_symbols[tag]->name,
+                global_stats.frees[tag] + live[tag], global_stats.frees[tag],
+                live[tag], global_stats.clones[tag]);
+    }
+
+    fprintf(out, "list-reallocs %zu\n", global_stats.list_reallocs);
+    fprintf(out, "list-copies %zu\n", global_stats.list_copies);
+    fprintf(out, "env-frames %zu\n", global_stats.env_frames);
+    fprintf(out, "env-depth-peak %zu\n", global_stats.env_depth_peak);
+}
+
+// A form the parser is in the middle of. The next value read is added to
+// `list`, a PARSE_WRAP list (such as `(quasiquote x)`) is complete after that
+// one value and a PARSE_LIST one when its `)` is read.
+typedef enum ParseFrameKind {
+    PARSE_LIST,
+    PARSE_QUOTE,
+    PARSE_WRAP,
+} ParseFrameKind;
+
+typedef struct ParseFrame {
+    ParseFrameKind kind;
+    List list;
+} ParseFrame;
+
+void parser_push(Parser* p, ParseFrame frame) {
+    if (p->stack_len == p->stack_cap) {
+        p->stack_cap = p->stack_cap ? p->stack_cap * 2 : 16;
+        p->stack = realloc(p->stack, p->stack_cap * sizeof(ParseFrame));
+    }
+
+    p->stack[p->stack_len++] = frame;
+}
+
+// Either a symbol literal, number literal, string literal, char literal
+Value* parse_atom(Parser* input) {
+    size_t i = 0;
+    if (parser_peek(input) == '"') {
+        // Consume first quote
+        parser_get(input);
+
+        if (input->source) {
+            // Without escapes the string can point into the mapping as is
+            size_t end = input->pos;
+            while (end < input->len && input->text[end] != '"' &&
+                   input->text[end] != '\\') {
+                end++;
+            }
+
+            if (end < input->len && input->text[end] == '"') {
+                Value* ret = valuepool_alloc(&global_vp);
+                ret->tag = STRING;
+                ret->val.string = input->text + input->pos;
+                ret->val.string_len = end - input->pos;
+                ret->val.string_source = input->source;
+                input->source->rc++;
+
+                input->pos = end + 1;
+                return ret;
+            }
+        }
+
+        for (; parser_peek(input) != '"' && !parser_eof(input); i++) {
+            if (parser_peek(input) == '\\') {
+                parser_get(input);
+            }
+
+            parser_token_put(input, i, parser_get(input));
+        }
+        parser_token_put(input, i, '\0');
+
+        parser_expect(input, '"');
+
+        Value* ret = valuepool_alloc(&global_vp);
+        ret->tag = STRING;
+        ret->val.string = strdup(input->token);
+        ret->val.string_len = i;
+
+        return ret;
+    } else {
+        // Mapped symbols are interned straight from the mapping, only
+        // numbers need a terminated copy for strtod
+        size_t start = input->pos;
+        bool mapped_symbol = input->source && start < input->len &&
+                             !isdigit(input->text[start]);
+
+        for (; !parser_eof(input) &&
+               !isspace((unsigned char)parser_peek(input)) &&
+               parser_peek(input) != '(' && parser_peek(input) != ')';
+             i++) {
+            char c = parser_get(input);
+
+            if (!mapped_symbol) {
+                parser_token_put(input, i, c);
+            }
+        }
+
+        if (mapped_symbol) {
+            Value* ret = valuepool_alloc(&global_vp);
+            ret->tag = SYMBOL;
+            ret->val.symbol = intern_n(input->text + start, i);
+            ret->val.slot = -1;
+
+            return ret;
+        }
+        parser_token_put(input, i, '\0');
+
+        if (isdigit(input->token[0])) {
+            // Parse number
+            return value_from_number(strtod(input->token, NULL));
+        }
+
+        // Symbol
+        Value* ret = valuepool_alloc(&global_vp);
+        ret->tag = SYMBOL;
+        ret->val.symbol = intern(input->token);
+        ret->val.slot = -1;
+
+        return ret;
+    }
+}
+
+// Nesting lives on the parser's stack rather than the C stack, so depth only
+// costs a frame per open form
+Value* parse(Parser* input) {
+    size_t base = input->stack_len;
+
+    for (;;) {
+        parser_skip_whitespace(input);
+
+        ParseFrame* top = NULL;
+        if (input->stack_len > base) {
+            top = &input->stack[input->stack_len - 1];
+        }
+        char c = parser_peek(input);
+        Value* v = NULL;
+
+        if (top && top->kind == PARSE_LIST && top->list.len > 0 &&
+            (c == ')' || parser_eof(input))) {
+            // Consume the closing `)`
+            parser_expect(input, ')');
+
+            v = valuepool_alloc(&global_vp);
+            v->tag = LIST;
+            v->val.list = top->list;
+            input->stack_len--;
+        } else if (c == ')' && !(top && top->kind == PARSE_LIST)) {
+            // Nothing open here for it to close, and leaving it unread would
+            // have every later parse stop at it again
+            fprintf(stderr, "error: unexpected ')'\n");
+            exit(1);
+        } else if (c == '\'') {
+            // Quote whatever expression comes next
+            parser_get(input);
+            parser_push(input, (ParseFrame){.kind = PARSE_QUOTE});
+            continue;
+        } else if (c == '`' || c == ',') {
+            // `x, ,x and ,@x are read as (quasiquote x), (unquote x) and
+            // (unquote-splicing x)
+            Symbol* symbol = &symbol_quasiquote;
+            if (parser_get(input) == ',') {
+                symbol = &symbol_unquote;
+
+                if (parser_peek(input) == '@') {
+                    parser_get(input);
+                    symbol = &symbol_unquote_splicing;
+                }
+            }
+
+            Value* head = valuepool_alloc(&global_vp);
+            head->tag = SYMBOL;
+            head->val.symbol = symbol;
+            head->val.slot = -1;
+
+            List l = list_init();
+            list_add(&l, head, false);
+            parser_push(input, (ParseFrame){.kind = PARSE_WRAP, .list = l});
+            continue;
+        } else if (c == '(') {
+            // Start of a list, its first element is read even if it's
+            // immediately closed
+            parser_expect(input, '(');
+            parser_push(input,
+                        (ParseFrame){.kind = PARSE_LIST, .list = list_init()});
+            continue;
+        } else {
+            v = parse_atom(input);
+        }
+
+        // Hand the value to the forms waiting on it, closing the ones it
+        // completes
+        while (input->stack_len > base) {
+            top = &input->stack[input->stack_len - 1];
+
+            if (top->kind == PARSE_QUOTE) {
+                v = value_box(v);
+                v->quoted += 1;
+            } else {
+                list_add(&top->list, v, false);
+
+                if (top->kind == PARSE_LIST) {
+                    break;
+                }
+
+                v = valuepool_alloc(&global_vp);
+                v->tag = LIST;
+                v->val.list = top->list;
+            }
+
+            input->stack_len--;
+        }
+
+        if (input->stack_len == base) {
+            return v;
+        }
+    }
+}
+
+Value* symbol_eq(size_t argc, Value** argv, Env* _) {
+    assert(argc == 2);
+
+    Value* lhs = argv[0];
+    Value* rhs = argv[1];
+
+    assert(value_tag(lhs) == SYMBOL);
+    assert(value_tag(rhs) == SYMBOL);
+
+    return value_from_boolean(lhs->val.symbol == rhs->val.symbol);
+}
+
+Value* string_eq(size_t argc, Value** argv, Env* _) {
+    assert(argc == 2);
+
+    Value* lhs = argv[0];
+    Value* rhs = argv[1];
+
+    assert(value_tag(lhs) == STRING);
+    assert(value_tag(rhs) == STRING);
+
+    return value_from_boolean(
+        lhs->val.string_len == rhs->val.string_len &&
+        !memcmp(lhs->val.string, rhs->val.string, lhs->val.string_len));
+}
+
+// (prepend list x)
+Value* builtin_list_prepend(size_t argc, Value** argv, Env* _) {
+    assert(argc == 2);
+    assert(value_tag(argv[0]) == LIST);
+
+    List new = list_share(argv[0]->val.list);
+    list_prepend(&new, argv[1], true);
+
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = LIST;
+    ret->val.list = new;
+
+    return ret;
+}
+
+// (append list x)
+Value* builtin_list_append(size_t argc, Value** argv, Env* _) {
+    assert(argc == 2);
+    assert(value_tag(argv[0]) == LIST);
+
+    List new = list_share(argv[0]->val.list);
+    list_add(&new, argv[1], true);
+
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = LIST;
+    ret->val.list = new;
+
+    return ret;
+}
+
+// (list arg1 arg2 ... argN)
+Value* builtin_list(size_t argc, Value** argv, Env* _) {
+    assert(argc >= 1);
+
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = LIST;
+    ret->val.list = list_init_slack(0, argc);
+    for (size_t i = 0; i < argc; i++) {
+        list_add(&ret->val.list, argv[i], true);
+    }
+
+    return ret;
+}
+
+// Bytecode engine, an alternative to `internal_eval`. Forms are compiled into
+// a `Chunk` of opcodes followed by their operands, and procedure bodies are
+// compiled the first time they're called. Anything the compiler doesn't
+// understand natively is handed to the tree-walker through OP_EVAL.
+typedef enum OpCode {
+    // Push constant as is, used for self evaluating numbers and strings
+    OP_CONST,
+    // Push a copy of a quoted constant with one level of quoting removed
+    OP_QUOTE,
+    // Push the value bound to a symbol constant
+    OP_LOOKUP,
+    OP_POP,
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_TRUE,
+    // Bind a symbol constant to the value on top of the stack, leaving it there
+    OP_DEFINE,
+    // Inspect the evaluated operator of a call form constant. Special forms
+    // and macros are handed the unevaluated form, then execution jumps past
+    // the argument code and OP_CALL. The second operand is the call's macro
+    // site, 0 until a macro is first found there.
+    OP_OPERATOR,
+    // OP_OPERATOR for a call headed by a symbol, looking the operator up
+    // through the symbol's call cache first
+    OP_LOOKUP_OPERATOR,
+    // Call the operator sitting below `argc` evaluated arguments, the second
+    // operand is the call form constant
+    OP_CALL,
+    // Evaluate a form constant with the tree-walker
+    OP_EVAL,
+    OP_RETURN,
+} OpCode;
+
+struct Chunk;
+
+// A macro call compiled into a chunk and what it expanded to. Like
+// `macro_expand_all`, a call site expands once, and again only if it later
+// finds a different macro. The first expansion is handed to the tree-walker,
+// most sites at top level or in an `eval` run once, and only a site reached
+// again compiles its expansion.
+typedef struct MacroSite {
+    Value* macro;
+    Value* expansion;
+    // NULL until the site is reached a second time
+    struct Chunk* chunk;
+} MacroSite;
+
+typedef struct Chunk {
+    uint32_t* code;
+    size_t len;
+    size_t cap;
+
+    Value** constants;
+    size_t constants_len;
+    size_t constants_cap;
+
+    MacroSite* sites;
+    size_t sites_len;
+    size_t sites_cap;
+} Chunk;
+
+Chunk chunk_init() {
+    return (Chunk){
+        .code = calloc(16, sizeof(uint32_t)),
+        .cap = 16,
+        .constants = calloc(8, sizeof(Value*)),
+        .constants_cap = 8,
+    };
+}
+
+void chunk_deinit(Chunk* c);
+
+// Empties a chunk to compile another form into, keeping its storage
+void chunk_clear(Chunk* c) {
+    for (size_t i = 0; i < c->constants_len; i++) {
+        value_deref(c->constants[i]);
+    }
+
+    for (size_t i = 0; i < c->sites_len; i++) {
+        value_deref(c->sites[i].macro);
+        value_deref(c->sites[i].expansion);
+
+        if (c->sites[i].chunk) {
+            chunk_deinit(c->sites[i].chunk);
+            free(c->sites[i].chunk);
+        }
+    }
+
+    c->len = 0;
+    c->constants_len = 0;
+    c->sites_len = 0;
+}
+
+void chunk_deinit(Chunk* c) {
+    chunk_clear(c);
+
+    free(c->code);
+    free(c->constants);
+    free(c->sites);
+}
+
+size_t chunk_emit(Chunk* c, uint32_t word) {
+    if (c->len >= c->cap) {
+        c->cap *= 2;
+        c->code = realloc(c->code, c->cap * sizeof(*c->code));
+    }
+
+    c->code[c->len] = word;
+    return c->len++;
+}
+
+// Adds a constant, taking a new reference to it
+uint32_t chunk_constant(Chunk* c, Value* v) {
+    if (c->constants_len >= c->constants_cap) {
+        c->constants_cap *= 2;
+        c->constants =
+            realloc(c->constants, c->constants_cap * sizeof(*c->constants));
+    }
+
+    value_ref(v);
+    c->constants[c->constants_len] = v;
+
+    return c->constants_len++;
+}
+
+uint32_t chunk_symbol(Chunk* c, Symbol* symbol) {
+    Value* v = valuepool_alloc(&global_vp);
+    v->tag = SYMBOL;
+    v->val.symbol = symbol;
+    v->val.slot = -1;
+
+    uint32_t ret = chunk_constant(c, v);
+    value_deref(v);
+
+    return ret;
+}
+
+// Adds an empty macro site, returning one past its index
+uint32_t chunk_site(Chunk* c) {
+    if (c->sites_len >= c->sites_cap) {
+        c->sites_cap = c->sites_cap ? c->sites_cap * 2 : 4;
+        c->sites = realloc(c->sites, c->sites_cap * sizeof(*c->sites));
+    }
+
+    c->sites[c->sites_len] = (MacroSite){0};
+    return ++c->sites_len;
+}
+
+void chunk_patch(Chunk* c, size_t at) { c->code[at] = c->len; }
+
+// The instruction control reaches from `ip`, following jumps
+OpCode chunk_next_op(const Chunk* c, size_t ip) {
+    while (c->code[ip] == OP_JUMP) {
+        ip = c->code[ip + 1];
+    }
+
+    return c->code[ip];
 }
 
-Value* handle_add(const Value* v, Env* _) { return handle_arithmetic(v, ADD); }
-Value* handle_sub(const Value* v, Env* _) { return handle_arithmetic(v, SUB); }
-Value* handle_mul(const Value* v, Env* _) { return handle_arithmetic(v, MUL); }
-Value* handle_div(const Value* v, Env* _) { return handle_arithmetic(v, DIV); }
-Value* handle_mod(const Value* v, Env* _) { return handle_arithmetic(v, MOD); }
+void compile(Chunk* c, const Value* v);
 
-typedef enum CompOp {
-    LT,
-    GT,
-    EQ,
-    LE,
-    GE,
-    NE,
-} CompOp;
-Value* handle_logical(const Value* v, const Env* e, CompOp op) {
-    assert(v->tag == LIST);
+// Special forms the compiler knows how to lay out as jumps, anything else is
+// compiled as a call
+bool compile_special_form(Chunk* c, const Value* v) {
     List l = v->val.list;
+    Symbol* head = l.values[0]->val.symbol;
+
+    if (head == &symbol_if && l.len == 4) {
+        compile(c, l.values[1]);
+        chunk_emit(c, OP_JUMP_IF_FALSE);
+        size_t to_else = chunk_emit(c, 0);
+
+        compile(c, l.values[2]);
+        chunk_emit(c, OP_JUMP);
+        size_t to_end = chunk_emit(c, 0);
+
+        chunk_patch(c, to_else);
+        compile(c, l.values[3]);
+        chunk_patch(c, to_end);
+
+        return true;
+    } else if ((head == &symbol_and || head == &symbol_or) && l.len > 1) {
+        // Both short circuit to a boolean, `and` on the first falsy value and
+        // `or` on the first truthy one
+        bool is_and = head == &symbol_and;
+        size_t* short_circuits = calloc(l.len, sizeof(size_t));
+
+        for (size_t i = 1; i < l.len; i++) {
+            compile(c, l.values[i]);
+            chunk_emit(c, is_and ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE);
+            short_circuits[i] = chunk_emit(c, 0);
+        }
 
-    assert(l.len == 2);
-
-    Value* first = v->val.list.values[0];
-    Value* second = v->val.list.values[1];
-    if (first->tag == NUMBER && second->tag == NUMBER) {
-        assert(first->tag == NUMBER);
-        assert(second->tag == NUMBER);
+        chunk_emit(c, OP_LOOKUP);
+        chunk_emit(c, chunk_symbol(c, is_and ? &symbol_t : &symbol_f));
+        chunk_emit(c, OP_JUMP);
+        size_t to_end = chunk_emit(c, 0);
 
-        Value* ret;
+        for (size_t i = 1; i < l.len; i++) {
+            chunk_patch(c, short_circuits[i]);
+        }
+        chunk_emit(c, OP_LOOKUP);
+        chunk_emit(c, chunk_symbol(c, is_and ? &symbol_f : &symbol_t));
+        chunk_patch(c, to_end);
+
+        free(short_circuits);
+        return true;
+    } else if (head == &symbol_progn && l.len > 1) {
+        for (size_t i = 1; i < l.len; i++) {
+            compile(c, l.values[i]);
+
+            if (i != l.len - 1) {
+                chunk_emit(c, OP_POP);
+            }
+        }
 
-        switch (op) {
-        case LT:
-            ret = env_get(e,
-                          (first->val.number < second->val.number) ? "t" : "f");
-            break;
-        case GT:
-            ret = env_get(e,
-                          (first->val.number > second->val.number) ? "t" : "f");
-            break;
-        case EQ:
-            ret = env_get(e, (first->val.number == second->val.number) ? "t"
-                                                                       : "f");
-            break;
-        case LE:
-            ret = env_get(e, (first->val.number <= second->val.number) ? "t"
-                                                                       : "f");
-            break;
-        case GE:
-            ret = env_get(e, (first->val.number >= second->val.number) ? "t"
-                                                                       : "f");
-            break;
-        case NE:
-            ret = env_get(e, (first->val.number != second->val.number) ? "t"
-                                                                       : "f");
-            break;
+        return true;
+    } else if (head == &symbol_cond && l.len > 1) {
+        for (size_t i = 1; i < l.len; i++) {
+            if (value_tag(l.values[i]) != LIST ||
+                l.values[i]->val.list.len != 2) {
+                return false;
+            }
         }
 
-        return ret;
-    } else if (first->tag == BOOLEAN && second->tag == BOOLEAN) {
-        assert(op == EQ || op == NE);
+        size_t* to_end = calloc(l.len, sizeof(size_t));
 
-        Value* ret;
+        for (size_t i = 1; i < l.len; i++) {
+            List case_list = l.values[i]->val.list;
 
-        switch (op) {
-        case EQ:
-            ret = env_get(e, (first->val.boolean == second->val.boolean) ? "t"
-                                                                         : "f");
-            break;
-        case NE:
-            ret = env_get(e, (first->val.boolean != second->val.boolean) ? "t"
-                                                                         : "f");
-            break;
-        default:
-            assert(false);
+            compile(c, case_list.values[0]);
+            chunk_emit(c, OP_JUMP_IF_FALSE);
+            size_t to_next = chunk_emit(c, 0);
+
+            compile(c, case_list.values[1]);
+            chunk_emit(c, OP_JUMP);
+            to_end[i] = chunk_emit(c, 0);
+
+            chunk_patch(c, to_next);
         }
 
-        return ret;
+        chunk_emit(c, OP_LOOKUP);
+        chunk_emit(c, chunk_symbol(c, &symbol_nil));
+
+        for (size_t i = 1; i < l.len; i++) {
+            chunk_patch(c, to_end[i]);
+        }
+
+        free(to_end);
+        return true;
+    } else if (head == &symbol_define && l.len == 3 &&
+               value_tag(l.values[1]) == SYMBOL) {
+        compile(c, l.values[2]);
+        chunk_emit(c, OP_DEFINE);
+        chunk_emit(c, chunk_constant(c, l.values[1]));
+
+        return true;
+    } else if (head == &symbol_define || head == &symbol_define_macro) {
+        // Procedure and macro definitions don't evaluate anything
+        chunk_emit(c, OP_EVAL);
+        chunk_emit(c, chunk_constant(c, (Value*)v));
+
+        return true;
     }
 
-    assert(false);
+    return false;
 }
 
-Value* handle_lt(const Value* v, Env* e) { return handle_logical(v, e, LT); };
-Value* handle_gt(const Value* v, Env* e) { return handle_logical(v, e, GT); };
-Value* handle_eq(const Value* v, Env* e) { return handle_logical(v, e, EQ); };
-Value* handle_le(const Value* v, Env* e) { return handle_logical(v, e, LE); };
-Value* handle_ge(const Value* v, Env* e) { return handle_logical(v, e, GE); };
-Value* handle_ne(const Value* v, Env* e) { return handle_logical(v, e, NE); };
+void compile(Chunk* c, const Value* v) {
+    if (value_quoted(v)) {
+        chunk_emit(c, OP_QUOTE);
+        chunk_emit(c, chunk_constant(c, (Value*)v));
+    } else if (value_tag(v) == LIST) {
+        List l = v->val.list;
+        assert(l.len > 0);
 
-Value* builtin_tagp(const Value* v, ValueTag tag) {
-    assert(v->tag == LIST);
-    List l = v->val.list;
-    assert(l.len == 1);
+        if (value_tag(l.values[0]) == SYMBOL && !value_quoted(l.values[0]) &&
+            compile_special_form(c, v)) {
+            return;
+        }
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = BOOLEAN;
+        if (value_tag(l.values[0]) == SYMBOL && !value_quoted(l.values[0])) {
+            chunk_emit(c, OP_LOOKUP_OPERATOR);
+        } else {
+            compile(c, l.values[0]);
+            chunk_emit(c, OP_OPERATOR);
+        }
+        uint32_t form = chunk_constant(c, (Value*)v);
+        chunk_emit(c, form);
+        chunk_emit(c, 0);
+        size_t to_end = chunk_emit(c, 0);
 
-    ret->val.boolean = l.values[0]->tag == tag;
+        for (size_t i = 1; i < l.len; i++) {
+            compile(c, l.values[i]);
+        }
 
-    return ret;
+        chunk_emit(c, OP_CALL);
+        chunk_emit(c, l.len - 1);
+        chunk_emit(c, form);
+        chunk_patch(c, to_end);
+    } else if (value_tag(v) == SYMBOL) {
+        chunk_emit(c, OP_LOOKUP);
+        chunk_emit(c, chunk_constant(c, (Value*)v));
+    } else if (value_tag(v) == NUMBER || value_tag(v) == STRING) {
+        chunk_emit(c, OP_CONST);
+        chunk_emit(c, chunk_constant(c, (Value*)v));
+    } else {
+        chunk_emit(c, OP_LOOKUP);
+        chunk_emit(c, chunk_symbol(c, &symbol_nil));
+    }
 }
 
-Value* builtin_nilp(const Value* v, Env* _) { return builtin_tagp(v, NIL); }
-Value* builtin_numberp(const Value* v, Env* _) {
-    return builtin_tagp(v, NUMBER);
-}
-Value* builtin_stringp(const Value* v, Env* _) {
-    return builtin_tagp(v, STRING);
-}
-Value* builtin_booleanp(const Value* v, Env* _) {
-    return builtin_tagp(v, BOOLEAN);
-}
-Value* builtin_procedurep(const Value* v, Env* _) {
-    return builtin_tagp(v, PROCEDURE);
-}
-Value* builtin_specialformp(const Value* v, Env* _) {
-    return builtin_tagp(v, SPECIAL_FORM);
+typedef struct Frame {
+    Chunk* chunk;
+    size_t ip;
+    Env* env;
+    // The procedure whose body is running, with a reference held until the
+    // frame is popped. Only these frames own their env, top level chunks and
+    // macro expansions run in their caller's.
+    Value* procedure;
+    // Set while the procedure is being profiled or traced
+    bool hooked;
+} Frame;
+
+// A procedure body compiled by the VM, found through the `compiled` index in
+// its header's signature. Holds a reference to the body it was compiled from,
+// the header name isn't referenced, it releases the entry when it's freed.
+typedef struct CompiledProcedure {
+    Value* name;
+    Value* body;
+    Chunk* chunk;
+    // While the entry is unused, one past the index of the next unused one
+    uint32_t next_free;
+} CompiledProcedure;
+
+typedef struct VM {
+    Value** stack;
+    size_t sp;
+    size_t stack_cap;
+
+    Frame* frames;
+    size_t frames_len;
+    size_t frames_cap;
+
+    CompiledProcedure* procedures;
+    size_t procedures_len;
+    size_t procedures_cap;
+    uint32_t procedures_free;
+
+    // Chunks replaced while a frame was still running them
+    Chunk** retired;
+    size_t retired_len;
+
+    // Call frames of returned procedures, emptied but keeping their storage
+    // for the next calls
+    Env** spare_envs;
+    size_t spare_envs_len;
+    size_t spare_envs_cap;
+
+    // Likewise the chunks `vm_eval` compiled its forms into
+    Chunk* spare_chunks;
+    size_t spare_chunks_len;
+    size_t spare_chunks_cap;
+} VM;
+
+VM global_vm;
+
+static inline void vm_push(VM* vm, Value* v) {
+    if (vm->sp >= vm->stack_cap) {
+        vm->stack_cap = vm->stack_cap ? vm->stack_cap * 2 : 256;
+        vm->stack = realloc(vm->stack, vm->stack_cap * sizeof(*vm->stack));
+    }
+
+    vm->stack[vm->sp++] = v;
 }
-Value* builtin_builtinp(const Value* v, Env* _) {
-    return builtin_tagp(v, BUILTIN);
+
+static inline Value* vm_pop(VM* vm) {
+    assert(vm->sp > 0);
+    return vm->stack[--vm->sp];
 }
-Value* builtin_symbolp(const Value* v, Env* _) {
-    return builtin_tagp(v, SYMBOL);
+
+void vm_push_frame(VM* vm, Frame f) {
+    if (vm->frames_len >= vm->frames_cap) {
+        vm->frames_cap = vm->frames_cap ? vm->frames_cap * 2 : 64;
+        vm->frames = realloc(vm->frames, vm->frames_cap * sizeof(*vm->frames));
+    }
+
+    vm->frames[vm->frames_len++] = f;
 }
-Value* builtin_listp(const Value* v, Env* _) { return builtin_tagp(v, LIST); }
-Value* builtin_macrop(const Value* v, Env* _) { return builtin_tagp(v, MACRO); }
 
-// Takes 1 arg
-Value* value_tag(const Value* v, Env* e) {
-    assert(v->tag == LIST);
-    List l = v->val.list;
-    assert(l.len == 1);
+Env* vm_alloc_env(VM* vm, size_t size, Env* parent) {
+    if (vm->spare_envs_len) {
+        Env* ret = vm->spare_envs[--vm->spare_envs_len];
+        env_reinit(ret, size, parent);
+        return ret;
+    }
 
-    Value* inner = l.values[0];
+    Env* ret = malloc(sizeof(Env));
+    *ret = env_init(size, parent);
+    return ret;
+}
 
-    switch (inner->tag) {
-    case NIL:
-        return env_get(e, "#nil");
-    case NUMBER:
-        return env_get(e, "#number");
-    case STRING:
-        return env_get(e, "#string");
-    case BOOLEAN:
-        return env_get(e, "#boolean");
-    case PROCEDURE:
-        return env_get(e, "#procedure");
-    case SPECIAL_FORM:
-        return env_get(e, "#special-form");
-    case BUILTIN:
-        return env_get(e, "#builtin");
-    case SYMBOL:
-        return env_get(e, "#symbol");
-    case LIST:
-        return env_get(e, "#list");
-    case MACRO:
-        return env_get(e, "#macro");
+void vm_release_env(VM* vm, Env* e) {
+    env_clear(e);
+
+    if (vm->spare_envs_len >= vm->spare_envs_cap) {
+        vm->spare_envs_cap = vm->spare_envs_cap ? vm->spare_envs_cap * 2 : 16;
+        vm->spare_envs = realloc(vm->spare_envs,
+                                 vm->spare_envs_cap * sizeof(*vm->spare_envs));
     }
+
+    vm->spare_envs[vm->spare_envs_len++] = e;
 }
 
-Value* parse(Parser* input) {
-    parser_skip_whitespace(input);
-    if (parser_peek(input) == '\'') {
-        // Parse expression into value, return it quoted
-        parser_get(input);
-        Value* v = parse(input);
-        v->quoted += 1;
+void vm_pop_frame(VM* vm) {
+    Frame* f = &vm->frames[--vm->frames_len];
 
-        return v;
+    if (f->hooked) {
+        call_exit();
+    }
+    if (f->procedure) {
+        vm_release_env(vm, f->env);
+        value_deref(f->procedure);
     }
-    if (parser_peek(input) != '(') {
-        // Entering from a recursive parse call
-        // The expression here should be a literal
-        // Either a symbol literal, number literal, string literal, char
-        // literal, quoted value
+}
 
-        char buf[256] = {0};
-        if (parser_peek(input) == '"') {
-            // Consume first quote
-            parser_get(input);
+// Frees a chunk nothing will run again, or keeps it until `vm_deinit` if a
+// frame is still running it
+void vm_release_chunk(VM* vm, Chunk* c) {
+    for (size_t i = 0; i < vm->frames_len; i++) {
+        if (vm->frames[i].chunk == c) {
+            vm->retired =
+                realloc(vm->retired, (vm->retired_len + 1) * sizeof(Chunk*));
+            vm->retired[vm->retired_len++] = c;
+            return;
+        }
+    }
 
-            for (int i = 0;
-                 parser_peek(input) != '"' && input->pos < input->len; i++) {
-                if (parser_peek(input) == '\\') {
-                    parser_get(input);
-                }
+    chunk_deinit(c);
+    free(c);
+}
 
-                buf[i] = parser_get(input);
-            }
+// Compiles a procedure body or macro expansion into a chunk that returns its
+// value
+Chunk* vm_compile_chunk(const Value* v) {
+    Chunk* ret = malloc(sizeof(Chunk));
+    *ret = chunk_init();
 
-            assert(parser_peek(input) == '"');
-            parser_get(input);
+    compile(ret, v);
+    chunk_emit(ret, OP_RETURN);
 
-            Value* ret = valuepool_alloc(&global_vp);
-            ret->tag = STRING;
-            ret->val.string = strdup(buf);
+    return ret;
+}
 
-            return ret;
-        } else {
-            for (int i = 0;
-                 parser_peek(input) != ' ' && parser_peek(input) != ')' &&
-                 input->pos < input->len;
-                 i++) {
-                buf[i] = parser_get(input);
-            }
+Chunk* vm_procedure_chunk(VM* vm, const Value* procedure) {
+    Value* name = procedure->val.list.values[0]->val.list.values[0];
+    Value* body = procedure->val.list.values[1];
+    signature_of(procedure->val.list.values[0]);
 
-            Value* ret = valuepool_alloc(&global_vp);
-            if (isdigit(buf[0])) {
-                // Parse number
-                ret->tag = NUMBER;
-                ret->val.number = strtod(buf, NULL);
-            } else {
-                // Symbol
-                ret->tag = SYMBOL;
-                ret->val.string = strdup(buf);
-            }
+    if (name->val.signature.compiled) {
+        CompiledProcedure* p =
+            vm->procedures + name->val.signature.compiled - 1;
 
-            return ret;
+        // A header evaluated by more than one definition can come with a body
+        // expanded differently each time
+        if (p->body == body) {
+            return p->chunk;
         }
-    }
 
-    assert(parser_peek(input) == '(');
-    parser_get(input);
+        vm_release_chunk(vm, p->chunk);
+        value_deref(p->body);
+
+        value_ref(body);
+        p->body = body;
+        p->chunk = vm_compile_chunk(body);
 
-    // If we make it here then the first symbol must be a function
-    // Start of a list
-    // (+ 1 2 (+ 3 4))
-    //  ^^^
-    List l = list_init();
+        return p->chunk;
+    }
 
-    Value* v = parse(input);
-    list_add(&l, v, false);
+    if (!vm->procedures_free) {
+        if (vm->procedures_len >= vm->procedures_cap) {
+            vm->procedures_cap =
+                vm->procedures_cap ? vm->procedures_cap * 2 : 64;
+            vm->procedures =
+                realloc(vm->procedures,
+                        vm->procedures_cap * sizeof(*vm->procedures));
+        }
 
-    while (parser_peek(input) != ')') {
-        v = parse(input);
-        list_add(&l, v, false);
+        vm->procedures_free = ++vm->procedures_len;
+        vm->procedures[vm->procedures_free - 1].next_free = 0;
     }
 
-    // Consume the closing `)`
-    assert(parser_peek(input) == ')');
-    parser_get(input);
+    uint32_t compiled = vm->procedures_free;
+    CompiledProcedure* p = vm->procedures + compiled - 1;
+    vm->procedures_free = p->next_free;
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = LIST;
-    ret->val.list = l;
+    value_ref(body);
+    *p = (CompiledProcedure){
+        .name = name, .body = body, .chunk = vm_compile_chunk(body)};
+    name->val.signature.compiled = compiled;
 
-    return ret;
+    return p->chunk;
 }
 
-Value* symbol_eq(const Value* v, Env* _) {
-    assert(v->tag == LIST);
-    List l = v->val.list;
-    assert(l.len == 2);
+// Called as a procedure header's name is freed, a frame running the body
+// holds a reference to the procedure so it can't be running
+void vm_forget_procedure(uint32_t compiled) {
+    VM* vm = &global_vm;
+    CompiledProcedure* p = vm->procedures + compiled - 1;
 
-    Value* lhs = l.values[0];
-    Value* rhs = l.values[1];
+    chunk_deinit(p->chunk);
+    free(p->chunk);
+    value_deref(p->body);
 
-    assert(lhs->tag == SYMBOL);
-    assert(rhs->tag == SYMBOL);
+    *p = (CompiledProcedure){.next_free = vm->procedures_free};
+    vm->procedures_free = compiled;
+}
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = BOOLEAN;
-    ret->val.boolean = !strcmp(lhs->val.string, rhs->val.string);
+void vm_deinit(VM* vm) {
+    assert(vm->sp == 0);
+    assert(vm->frames_len == 0);
 
-    return ret;
-}
+    for (size_t i = 0; i < vm->procedures_len; i++) {
+        CompiledProcedure* p = vm->procedures + i;
 
-Value* string_eq(const Value* v, Env* _) {
-    assert(v->tag == LIST);
-    List l = v->val.list;
-    assert(l.len == 2);
+        if (p->chunk) {
+            // Headers outliving the VM shouldn't release it again
+            p->name->val.signature.compiled = 0;
 
-    Value* lhs = l.values[0];
-    Value* rhs = l.values[1];
+            chunk_deinit(p->chunk);
+            free(p->chunk);
+            value_deref(p->body);
+        }
+    }
 
-    assert(lhs->tag == STRING);
-    assert(rhs->tag == STRING);
+    for (size_t i = 0; i < vm->retired_len; i++) {
+        chunk_deinit(vm->retired[i]);
+        free(vm->retired[i]);
+    }
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = BOOLEAN;
-    ret->val.boolean = !strcmp(lhs->val.string, rhs->val.string);
+    for (size_t i = 0; i < vm->spare_envs_len; i++) {
+        env_deinit(vm->spare_envs[i]);
+        free(vm->spare_envs[i]);
+    }
 
-    return ret;
-}
+    for (size_t i = 0; i < vm->spare_chunks_len; i++) {
+        chunk_deinit(&vm->spare_chunks[i]);
+    }
 
-// (prepend list x)
-Value* builtin_list_prepend(const Value* v, Env* _) {
-    assert(v->tag == LIST);
-    List args = v->val.list;
+    free(vm->procedures);
+    free(vm->retired);
+    free(vm->spare_envs);
+    free(vm->spare_chunks);
+    free(vm->frames);
+    free(vm->stack);
 
-    assert(args.len == 2);
-    assert(args.values[0]->tag == LIST);
+    *vm = (VM){0};
+}
 
-    List old = args.values[0]->val.list;
-    Value* to_add = args.values[1];
-    List new = list_init();
+// Binds the `argc` evaluated arguments to the procedure's parameters in a
+// fresh env, taking over the stack's references to them
+Env* vm_bind_arguments(VM* vm, const Value* procedure, Value** args,
+                       size_t argc, Env* parent) {
+    const Value* header = procedure->val.list.values[0];
+    Signature sig = signature_of(header);
+    signature_check(header, sig, argc);
 
-    list_add(&new, to_add, true);
+    Env* env = vm_alloc_env(vm, sig.required + sig.rest, parent);
 
-    for (size_t i = 0; i < old.len; i++) {
-        list_add(&new, old.values[i], true);
+    for (size_t i = 0; i < sig.required; i++) {
+        env_bind(env, signature_param(header, sig, i), args[i]);
     }
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = LIST;
-    ret->val.list = new;
+    if (sig.rest) {
+        // Map all remaining arguments into a list
+        List rest_args = list_init_slack(0, argc - sig.required);
+        for (size_t i = sig.required; i < argc; i++) {
+            list_add(&rest_args, args[i], false);
+        }
 
-    return ret;
+        Value* rest = valuepool_alloc(&global_vp);
+        rest->tag = LIST;
+        rest->val.list = rest_args;
+
+        env_bind(env, signature_param(header, sig, sig.required), rest);
+    }
+
+    return env;
 }
 
-// (append list x)
-Value* builtin_list_append(const Value* v, Env* _) {
-    assert(v->tag == LIST);
-    List args = v->val.list;
+Value* vm_run(VM* vm, Chunk* chunk, Env* env) {
+    // Builtins like eval can re-enter the VM, each run returns once its own
+    // bottom frame does
+    size_t base = vm->frames_len;
+    vm_push_frame(vm, (Frame){.chunk = chunk, .env = env});
+
+    // The running frame, with its chunk and instruction pointer kept in
+    // locals. `f->ip` is only written back before anything that can push a
+    // frame or re-enter the VM, and all of them are reloaded after.
+    Frame* f = &vm->frames[vm->frames_len - 1];
+    size_t ip = 0;
+    const uint32_t* code = chunk->code;
+    Value** constants = chunk->constants;
+
+    while (true) {
+        eval_steps++;
+
+        switch ((OpCode)code[ip++]) {
+        case OP_CONST: {
+            Value* v = constants[code[ip++]];
+            value_ref(v);
+            vm_push(vm, v);
+        } break;
+        case OP_QUOTE: {
+            vm_push(vm, value_unquote(constants[code[ip++]]));
+        } break;
+        case OP_LOOKUP:
+            vm_push(vm, env_get_ref(f->env, constants[code[ip++]]));
+            break;
+        case OP_POP:
+            value_deref(vm_pop(vm));
+            break;
+        case OP_JUMP:
+            ip = code[ip];
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE: {
+            bool jump_if = code[ip - 1] == OP_JUMP_IF_TRUE;
+            uint32_t target = code[ip++];
 
-    assert(args.len == 2);
-    assert(args.values[0]->tag == LIST);
+            Value* condition = vm_pop(vm);
+            bool truthy = value_truthy(condition);
+            value_deref(condition);
 
-    List old = args.values[0]->val.list;
-    Value* to_add = args.values[1];
-    List new = list_init();
+            if (truthy == jump_if) {
+                ip = target;
+            }
+        } break;
+        case OP_DEFINE:
+            env_put(f->env, constants[code[ip++]]->val.symbol,
+                    vm->stack[vm->sp - 1]);
+            break;
+        case OP_OPERATOR:
+        case OP_LOOKUP_OPERATOR: {
+            bool lookup = code[ip - 1] == OP_LOOKUP_OPERATOR;
+            const Value* form = constants[code[ip++]];
+            size_t site_at = ip++;
+            uint32_t after_call = code[ip++];
+
+            if (lookup) {
+                Value* head = form->val.list.values[0];
+                Value* procedure = env_get_operator(f->env, head);
+                vm_push(vm, procedure ? procedure : env_get_ref(f->env, head));
+            }
+            Value* procedure = vm->stack[vm->sp - 1];
 
-    for (size_t i = 0; i < old.len; i++) {
-        list_add(&new, old.values[i], true);
-    }
+            if (value_tag(procedure) == SPECIAL_FORM) {
+                vm->sp--;
+                f->ip = after_call;
 
-    list_add(&new, to_add, true);
+                // Traced like in `internal_eval`, the forms compiled to jumps
+                // have no span of their own
+                if (global_tracer.enabled) {
+                    trace_begin(profile_name(procedure, form)->name, form);
+                }
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = LIST;
-    ret->val.list = new;
+                // Special forms evaluate their own arguments
+                Value* ret = procedure->val.builtin(form, f->env);
 
-    return ret;
-}
+                if (global_tracer.enabled) {
+                    trace_end();
+                }
+                value_deref(procedure);
+                vm_push(vm, ret);
+            } else if (value_tag(procedure) == MACRO) {
+                vm->sp--;
+                f->ip = after_call;
+
+                // Expanding can run the VM again, which may add macro sites
+                // to this chunk or move the frames
+                Chunk* c = f->chunk;
+                uint32_t site = code[site_at];
+
+                if (!site || c->sites[site - 1].macro != procedure) {
+                    if (call_hooks) {
+                        call_enter(procedure, form);
+                    }
 
-// (list arg1 arg2 ... argN)
-Value* builtin_list(const Value* v, Env* _) {
-    assert(v->tag == LIST);
-    List args = v->val.list;
+                    Value* expansion = macro_expand(procedure, form, f->env);
+
+                    if (call_hooks) {
+                        call_exit();
+                    }
+
+                    site = c->code[site_at];
+                    if (site) {
+                        MacroSite* old = &c->sites[site - 1];
+                        value_deref(old->macro);
+                        value_deref(old->expansion);
+                        if (old->chunk) {
+                            vm_release_chunk(vm, old->chunk);
+                        }
+                    } else {
+                        site = chunk_site(c);
+                        c->code[site_at] = site;
+                    }
+
+                    value_ref(expansion);
+                    c->sites[site - 1] = (MacroSite){.macro = procedure,
+                                                     .expansion = expansion};
+
+                    // Runs in the caller's env, like the compiled expansion
+                    f = &vm->frames[vm->frames_len - 1];
+                    vm_push(vm, internal_eval(expansion, f->env));
+                    value_deref(expansion);
+                } else {
+                    value_deref(procedure);
+
+                    MacroSite* cached = &c->sites[site - 1];
+                    if (!cached->chunk) {
+                        cached->chunk = vm_compile_chunk(cached->expansion);
+                    }
+
+                    // Leaves its result for the caller like a call would
+                    vm_push_frame(vm, (Frame){.chunk = cached->chunk,
+                                              .env = f->env});
+                }
+            } else {
+                break;
+            }
+
+            f = &vm->frames[vm->frames_len - 1];
+            ip = f->ip;
+            code = f->chunk->code;
+            constants = f->chunk->constants;
+        } break;
+        case OP_CALL: {
+            size_t argc = code[ip++];
+            const Value* form = constants[code[ip++]];
+            Value** args = vm->stack + vm->sp - argc;
+            Value* procedure = args[-1];
+
+            if (value_tag(procedure) == BUILTIN) {
+                // A builtin like `eval` can run the VM again and grow the
+                // stack, so the arguments move off it first
+                Value* stack_argv[BUILTIN_STACK_ARGS];
+                Value** argv = argc <= BUILTIN_STACK_ARGS
+                                   ? stack_argv
+                                   : malloc(argc * sizeof(*argv));
+                memcpy(argv, args, argc * sizeof(*argv));
+                vm->sp -= argc + 1;
+
+                f->ip = ip;
+                Value* ret;
+                if (call_hooks) {
+                    call_enter(procedure, form);
+                    ret = builtin_call(procedure, argc, argv, f->env);
+                    call_exit();
+                } else {
+                    ret = builtin_call(procedure, argc, argv, f->env);
+                }
+                if (argv != stack_argv) {
+                    free(argv);
+                }
 
-    assert(args.len >= 1);
+                value_deref(procedure);
+                vm_push(vm, ret);
 
-    List new = list_init();
+                f = &vm->frames[vm->frames_len - 1];
+                break;
+            } else if (value_tag(procedure) != PROCEDURE) {
+                fprintf(stderr, "error: attempting to call a non procedure\n");
+                assert(false);
+            }
+
+            Env* funcall_env =
+                vm_bind_arguments(vm, procedure, args, argc, f->env);
+            Chunk* body = vm_procedure_chunk(vm, procedure);
+            vm->sp -= argc + 1;
+
+            // A call right before this frame returns replaces it, under the
+            // same condition as in `internal_eval`
+            if (f->procedure && chunk_next_op(f->chunk, ip) == OP_RETURN &&
+                env_shadows(funcall_env, f->env)) {
+                env_reparent(funcall_env, f->env->parent);
+                vm_pop_frame(vm);
+            } else {
+                f->ip = ip;
+            }
+
+            // A tail call ends the hooked activation it replaces above
+            if (call_hooks) {
+                call_enter(procedure, form);
+            }
+            vm_push_frame(vm, (Frame){.chunk = body,
+                                      .env = funcall_env,
+                                      .procedure = procedure,
+                                      .hooked = call_hooks});
+            f = &vm->frames[vm->frames_len - 1];
+
+            ip = 0;
+            code = body->code;
+            constants = body->constants;
+        } break;
+        case OP_EVAL: {
+            const Value* form = constants[code[ip++]];
+
+            f->ip = ip;
+            vm_push(vm, internal_eval(form, f->env));
+            f = &vm->frames[vm->frames_len - 1];
+        } break;
+        case OP_RETURN: {
+            Value* ret = vm_pop(vm);
+            vm_pop_frame(vm);
+
+            if (vm->frames_len == base) {
+                return ret;
+            }
+
+            vm_push(vm, ret);
 
-    for (size_t i = 0; i < args.len; i++) {
-        list_add(&new, args.values[i], true);
+            f = &vm->frames[vm->frames_len - 1];
+            ip = f->ip;
+            code = f->chunk->code;
+            constants = f->chunk->constants;
+        } break;
+        }
     }
+}
 
-    Value* ret = valuepool_alloc(&global_vp);
-    ret->tag = LIST;
-    ret->val.list = new;
+Value* vm_eval(const Value* v, Env* e) {
+    VM* vm = &global_vm;
+    Chunk c =
+        vm->spare_chunks_len ? vm->spare_chunks[--vm->spare_chunks_len]
+                             : chunk_init();
+    compile(&c, v);
+    chunk_emit(&c, OP_RETURN);
+
+    Value* ret = vm_run(vm, &c, e);
+    chunk_clear(&c);
+
+    if (vm->spare_chunks_len >= vm->spare_chunks_cap) {
+        vm->spare_chunks_cap =
+            vm->spare_chunks_cap ? vm->spare_chunks_cap * 2 : 4;
+        vm->spare_chunks =
+            realloc(vm->spare_chunks,
+                    vm->spare_chunks_cap * sizeof(*vm->spare_chunks));
+    }
+    vm->spare_chunks[vm->spare_chunks_len++] = c;
 
     return ret;
 }
 
-typedef struct Test {
-    char* input;
-    char* output;
-} Test;
+typedef enum Engine {
+    ENGINE_TREE,
+    ENGINE_VM,
+} Engine;
 
-#define VP_SIZE 1000
+Engine engine = ENGINE_TREE;
 
-int main(int argc, char* argv[]) {
-    /* char buf[4096] = {0}; */
-    /* while (true) { */
-    /*     printf("jisp> "); */
-    /*     fgets(buf, sizeof(buf), stdin); */
-
-    /*     if (buf[0] != '(') { */
-    /*         continue; */
-    /*     } */
-
-    /*     Parser p = (Parser){.text = buf, .pos = 0}; */
-
-    /*     Value v = parse(&p); */
-    /* } */
-
-    global_vp = valuepool_init((Value[VP_SIZE]){}, (bool[VP_SIZE]){}, VP_SIZE);
-
-    Env global_env = env_init();
-    env_put(&global_env, "+",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_add, .rc = 1});
-    env_put(&global_env, "-",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_sub, .rc = 1});
-    env_put(&global_env, "*",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_mul, .rc = 1});
-    env_put(&global_env, "/",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_div, .rc = 1});
-    env_put(&global_env, "%",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_mod, .rc = 1});
-    env_put(&global_env, "<",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_lt, .rc = 1});
-    env_put(&global_env, ">",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_gt, .rc = 1});
-    env_put(&global_env, "=",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_eq, .rc = 1});
-    env_put(&global_env,
-            "<=", &(Value){.tag = BUILTIN, .val.builtin = handle_le, .rc = 1});
-    env_put(&global_env,
-            ">=", &(Value){.tag = BUILTIN, .val.builtin = handle_ge, .rc = 1});
-    env_put(&global_env,
-            "!=", &(Value){.tag = BUILTIN, .val.builtin = handle_ne, .rc = 1});
-    env_put(&global_env, "symbol-eq",
-            &(Value){.tag = BUILTIN, .val.builtin = symbol_eq, .rc = 1});
-    env_put(&global_env, "string-eq",
-            &(Value){.tag = BUILTIN, .val.builtin = string_eq, .rc = 1});
-    env_put(&global_env, "display",
-            &(Value){.tag = BUILTIN, .val.builtin = handle_display, .rc = 1});
-    env_put(&global_env, "eval",
-            &(Value){.tag = BUILTIN, .val.builtin = eval, .rc = 1});
-    env_put(&global_env, "car",
-            &(Value){.tag = BUILTIN, .val.builtin = car, .rc = 1});
-    env_put(&global_env, "cdr",
-            &(Value){.tag = BUILTIN, .val.builtin = cdr, .rc = 1});
-    env_put(&global_env, "if",
-            &(Value){.tag = SPECIAL_FORM, .val.builtin = handle_if, .rc = 1});
-    env_put(
-        &global_env, "define",
-        &(Value){.tag = SPECIAL_FORM, .val.builtin = handle_define, .rc = 1});
-    env_put(&global_env, "define-macro",
-            &(Value){.tag = SPECIAL_FORM,
-                     .val.builtin = handle_define_macro,
-                     .rc = 1});
-    env_put(&global_env, "and",
-            &(Value){.tag = SPECIAL_FORM, .val.builtin = handle_and, .rc = 1});
-    env_put(&global_env, "or",
-            &(Value){.tag = SPECIAL_FORM, .val.builtin = handle_or, .rc = 1});
-    env_put(
-        &global_env, "progn",
-        &(Value){.tag = SPECIAL_FORM, .val.builtin = handle_progn, .rc = 1});
-    env_put(&global_env, "cond",
-            &(Value){.tag = SPECIAL_FORM, .val.builtin = handle_cond, .rc = 1});
-    env_put(&global_env, "t", &t);
-    env_put(&global_env, "f", &f);
-    env_put(&global_env, "nil", &nil);
-    env_put(&global_env, "#nil", &type_nil);
-    env_put(&global_env, "#number", &type_number);
-    env_put(&global_env, "#string", &type_string);
-    env_put(&global_env, "#boolean", &type_boolean);
-    env_put(&global_env, "#procedure", &type_procedure);
-    env_put(&global_env, "#special-form", &type_specialform);
-    env_put(&global_env, "#symbol", &type_symbol);
-    env_put(&global_env, "#list", &type_list);
-    env_put(&global_env, "#macro", &type_macro);
-    env_put(&global_env, "nil?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_nilp, .rc = 1});
-    env_put(&global_env, "number?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_numberp, .rc = 1});
-    env_put(&global_env, "string?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_stringp, .rc = 1});
-    env_put(&global_env, "boolean?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_booleanp, .rc = 1});
-    env_put(
-        &global_env, "procedure?",
-        &(Value){.tag = BUILTIN, .val.builtin = builtin_procedurep, .rc = 1});
-    env_put(
-        &global_env, "special-form?",
-        &(Value){.tag = BUILTIN, .val.builtin = builtin_specialformp, .rc = 1});
-    env_put(&global_env, "builtin?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_builtinp, .rc = 1});
-    env_put(&global_env, "symbol?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_symbolp, .rc = 1});
-    env_put(&global_env, "list?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_listp, .rc = 1});
-    env_put(&global_env, "macro?",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_macrop, .rc = 1});
-    env_put(&global_env, "tag",
-            &(Value){.tag = BUILTIN, .val.builtin = value_tag, .rc = 1});
-    env_put(
-        &global_env, "prepend",
-        &(Value){.tag = BUILTIN, .val.builtin = builtin_list_prepend, .rc = 1});
-    env_put(
-        &global_env, "append",
-        &(Value){.tag = BUILTIN, .val.builtin = builtin_list_append, .rc = 1});
-    env_put(&global_env, "list",
-            &(Value){.tag = BUILTIN, .val.builtin = builtin_list, .rc = 1});
+// Evaluates a form with whichever engine was picked at startup
+Value* engine_eval(const Value* v, Env* e) {
+    if (engine == ENGINE_VM) {
+        return vm_eval(v, e);
+    }
+
+    return internal_eval(v, e);
+}
+
+// Builtins and special forms bound in every global environment. The values
+// live here for the whole run, environments only hold references to them.
+typedef struct GlobalBinding {
+    const char* name;
+    Symbol* symbol;
+    Value value;
+} GlobalBinding;
+
+GlobalBinding global_bindings[] = {
+    {.name = "+",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_add, .rc = 1}},
+    {.name = "-",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_sub, .rc = 1}},
+    {.name = "*",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_mul, .rc = 1}},
+    {.name = "/",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_div, .rc = 1}},
+    {.name = "%",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_mod, .rc = 1}},
+    {.name = "<",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_lt, .rc = 1}},
+    {.name = ">",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_gt, .rc = 1}},
+    {.name = "=",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_eq, .rc = 1}},
+    {.name = "<=",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_le, .rc = 1}},
+    {.name = ">=",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_ge, .rc = 1}},
+    {.name = "!=",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_ne, .rc = 1}},
+    {.name = "symbol-eq",
+     .value = {.tag = BUILTIN, .val.builtin_argv = symbol_eq, .rc = 1}},
+    {.name = "string-eq",
+     .value = {.tag = BUILTIN, .val.builtin_argv = string_eq, .rc = 1}},
+    {.name = "display",
+     .value = {.tag = BUILTIN, .val.builtin_argv = handle_display, .rc = 1}},
+    {.name = "eval",
+     .value = {.tag = BUILTIN, .val.builtin_argv = eval, .rc = 1}},
+    {.name = "car",
+     .value = {.tag = BUILTIN, .val.builtin_argv = car, .rc = 1}},
+    {.name = "cdr",
+     .value = {.tag = BUILTIN, .val.builtin_argv = cdr, .rc = 1}},
+    {.symbol = &symbol_if,
+     .value = {.tag = SPECIAL_FORM, .val.builtin = handle_if, .rc = 1}},
+    {.symbol = &symbol_define,
+     .value = {.tag = SPECIAL_FORM, .val.builtin = handle_define, .rc = 1}},
+    {.symbol = &symbol_define_macro,
+     .value = {.tag = SPECIAL_FORM,
+               .val.builtin = handle_define_macro,
+               .rc = 1}},
+    {.symbol = &symbol_and,
+     .value = {.tag = SPECIAL_FORM, .val.builtin = handle_and, .rc = 1}},
+    {.symbol = &symbol_or,
+     .value = {.tag = SPECIAL_FORM, .val.builtin = handle_or, .rc = 1}},
+    {.symbol = &symbol_progn,
+     .value = {.tag = SPECIAL_FORM, .val.builtin = handle_progn, .rc = 1}},
+    {.symbol = &symbol_cond,
+     .value = {.tag = SPECIAL_FORM, .val.builtin = handle_cond, .rc = 1}},
+    {.symbol = &symbol_quasiquote,
+     .value = {.tag = SPECIAL_FORM, .val.builtin = handle_quasiquote, .rc = 1}},
+    {.name = "nil?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_nilp, .rc = 1}},
+    {.name = "number?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_numberp, .rc = 1}},
+    {.name = "string?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_stringp, .rc = 1}},
+    {.name = "boolean?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_booleanp, .rc = 1}},
+    {.name = "procedure?",
+     .value = {.tag = BUILTIN,
+               .val.builtin_argv = builtin_procedurep,
+               .rc = 1}},
+    {.name = "special-form?",
+     .value = {.tag = BUILTIN,
+               .val.builtin_argv = builtin_specialformp,
+               .rc = 1}},
+    {.name = "builtin?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_builtinp, .rc = 1}},
+    {.name = "symbol?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_symbolp, .rc = 1}},
+    {.name = "list?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_listp, .rc = 1}},
+    {.name = "macro?",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_macrop, .rc = 1}},
+    {.name = "tag",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_tag, .rc = 1}},
+    {.name = "prepend",
+     .value = {.tag = BUILTIN,
+               .val.builtin_argv = builtin_list_prepend,
+               .rc = 1}},
+    {.name = "append",
+     .value = {.tag = BUILTIN,
+               .val.builtin_argv = builtin_list_append,
+               .rc = 1}},
+    {.name = "list",
+     .value = {.tag = BUILTIN, .val.builtin_argv = builtin_list, .rc = 1}},
+    {.name = "runtime-stats",
+     .value = {.tag = BUILTIN,
+               .val.builtin_argv = builtin_runtime_stats,
+               .rc = 1}},
+};
+
+void global_env_init(Env* global_env) {
+    *global_env = env_init(64, NULL);
+
+    size_t len = sizeof(global_bindings) / sizeof(*global_bindings);
+    for (size_t i = 0; i < len; i++) {
+        GlobalBinding* binding = &global_bindings[i];
+        Symbol* symbol =
+            binding->symbol ? binding->symbol : intern(binding->name);
+
+        env_put(global_env, symbol, &binding->value);
+    }
+
+    env_put(global_env, &symbol_t, VALUE_TRUE);
+    env_put(global_env, &symbol_f, VALUE_FALSE);
+    env_put(global_env, &symbol_nil, VALUE_NIL);
+    env_put(global_env, &symbol_type_nil, &type_nil);
+    env_put(global_env, &symbol_type_number, &type_number);
+    env_put(global_env, &symbol_type_string, &type_string);
+    env_put(global_env, &symbol_type_boolean, &type_boolean);
+    env_put(global_env, &symbol_type_procedure, &type_procedure);
+    env_put(global_env, &symbol_type_specialform, &type_specialform);
+    env_put(global_env, &symbol_type_symbol, &type_symbol);
+    env_put(global_env, &symbol_type_list, &type_list);
+    env_put(global_env, &symbol_type_macro, &type_macro);
 
     char* eq = "(define (eq a b)"
                "    (and"
@@ -1389,14 +4486,64 @@ int main(int argc, char* argv[]) {
                "       (t f))))";
 
     {
-        Parser input = (Parser){.text = eq, .pos = 0, .len = strlen(eq)};
+        Parser input = parser_init(eq);
         Value* parsed = parse(&input);
-        Value* evaled = internal_eval(parsed, &global_env);
+        Value* evaled = engine_eval(parsed, global_env);
 
         value_deref(parsed);
         value_deref(evaled);
+        parser_deinit(&input);
+    }
+}
+
+typedef struct Test {
+    char* input;
+    char* output;
+} Test;
+
+// Parses and evaluates one top level form at a time, so memory use doesn't
+// grow with the size of the input. A REPL prompts for every form and prints
+// its value.
+void run_forms(Parser* input, Env* global_env, bool repl) {
+    while (true) {
+        if (repl) {
+            printf("jisp> ");
+            fflush(stdout);
+        }
+
+        parser_skip_whitespace(input);
+        if (parser_eof(input)) {
+            break;
+        }
+
+        Value* parsed = parse(input);
+        if (global_tracer.enabled) {
+            trace_begin("top-level", parsed);
+        }
+
+        Value* expanded = macro_expand_all(parsed, (List){0}, global_env);
+        value_deref(parsed);
+
+        Value* result = engine_eval(expanded, global_env);
+        if (global_tracer.enabled) {
+            trace_end();
+        }
+
+        if (repl) {
+            value_print(result);
+            printf("\n");
+        }
+
+        value_deref(result);
+        value_deref(expanded);
+    }
+
+    if (repl) {
+        printf("\n");
     }
+}
 
+void run_tests(Env* global_env) {
     // TODO develop a value equals function
     Test tests[] = {
         (Test){.input = "(car '(1 2 3))", .output = "1"},
@@ -1484,7 +4631,7 @@ int main(int argc, char* argv[]) {
         (Test){.input = "(map 'add1 '(3 6 9))", .output = "'(4 7 10)"},
         (Test){
             .input =
-                "(define (prepend-not-nil l x) (if (eq '(nil) (display x)) l "
+                "(define (prepend-not-nil l x) (if (eq '(nil) l) (list x) "
                 "(prepend l x)))",
             .output = "prepend-not-nil"},
         (Test){.input =
@@ -1498,18 +4645,65 @@ int main(int argc, char* argv[]) {
         (Test){.input = "(define-macro (test a b) (list 'eq a b))",
                .output = "test"},
         (Test){.input = "(test (+ 5 2) (+ 6 1))", .output = "t"},
+        (Test){.input = "(define (same? a b) (test a b))", .output = "same?"},
+        (Test){.input = "(same? 3 (+ 1 2))", .output = "t"},
+        (Test){.input = "`(1 ,(+ 1 1) ,@(list 3 4))", .output = "'(1 2 3 4)"},
+        (Test){.input = "(define-macro (test-qq a b) `(eq ,a ,b))",
+               .output = "test-qq"},
+        (Test){.input = "(test-qq (+ 5 2) (+ 6 1))", .output = "t"},
+        (Test){.input = "(list? (car (runtime-stats)))", .output = "t"},
+        (Test){.input = "(define (bump x) (+ x 1))", .output = "bump"},
+        (Test){.input = "(define (use-bump x) (bump x))", .output = "use-bump"},
+        (Test){.input = "(use-bump 1)", .output = "2"},
+        (Test){.input = "(define (bump x) (+ x 10))", .output = "bump"},
+        (Test){.input = "(use-bump 1)", .output = "11"},
+        (Test){.input = "(define (via-bump bump x) (use-bump x))",
+               .output = "via-bump"},
+        (Test){.input = "(via-bump sub1 1)", .output = "0"},
+        (Test){.input = "(define (test-rest-after a &rest args) args)",
+               .output = "test-rest-after"},
+        (Test){.input = "(test-rest-after 1 2 3)", .output = "'(2 3)"},
+        (Test){.input = "(define (see-x) x)", .output = "see-x"},
+        (Test){.input = "(define (tail-see-x x) (see-x))",
+               .output = "tail-see-x"},
+        (Test){.input = "(tail-see-x 5)", .output = "5"},
+        (Test){.input = "(define-macro (twice x) (list '+ x x))",
+               .output = "twice"},
+        (Test){.input = "(define (apply-twice twice y) (twice y))",
+               .output = "apply-twice"},
+        (Test){.input = "(apply-twice add1 3)", .output = "4"},
+        (Test){.input = "(define-macro (thrice x) (list '+ x x x))",
+               .output = "thrice"},
+        (Test){.input = "(define (sum-via m n acc) "
+                        "(if (= n 0) acc (sum-via m (- n 1) (+ acc (m n)))))",
+               .output = "sum-via"},
+        (Test){.input = "(sum-via twice 3 0)", .output = "12"},
+        (Test){.input = "(sum-via thrice 3 0)", .output = "18"},
+        (Test){.input = "`(1 ,@(cdr (list 1)) 2)", .output = "'(1 2)"},
+        (Test){.input = "(define-macro (qm x) `(list 'q ',x))",
+               .output = "qm"},
+        (Test){.input = "(qm hello)", .output = "'(q hello)"},
+        (Test){.input = "(define (quote-in-qq x) `(a ',x))",
+               .output = "quote-in-qq"},
+        (Test){.input = "(quote-in-qq 5)", .output = "'(a '5)"},
+        (Test){.input = "(eval (car (cdr (quote-in-qq 'b))))",
+               .output = "'b"},
     };
 
     for (size_t i = 0; i < sizeof(tests) / sizeof(*tests); i++) {
-        Parser input = (Parser){
-            .text = tests[i].input, .pos = 0, .len = strlen(tests[i].input)};
-        Parser output = (Parser){
-            .text = tests[i].output, .pos = 0, .len = strlen(tests[i].output)};
+        Parser input = parser_init(tests[i].input);
+        Parser output = parser_init(tests[i].output);
 
         Value* parse_input = parse(&input);
         Value* parse_output = parse(&output);
 
-        Value* eq_symbol = env_get(&global_env, "eq");
+        // Top level forms get their macros expanded once, like procedure
+        // bodies do in `handle_define`
+        Value* expanded = macro_expand_all(parse_input, (List){0}, global_env);
+        value_deref(parse_input);
+        parse_input = expanded;
+
+        Value* eq_symbol = env_get(global_env, intern("eq"));
         Value* eq_proc = value_clone(eq_symbol);
         eq_proc->quoted++;
         value_deref(eq_symbol);
@@ -1522,15 +4716,15 @@ int main(int argc, char* argv[]) {
         to_eval->tag = LIST;
         to_eval->val.list = l;
 
-        Value* result = internal_eval(to_eval, &global_env);
-        assert(result->tag == BOOLEAN);
+        Value* result = engine_eval(to_eval, global_env);
+        assert(value_tag(result) == BOOLEAN);
 
-        if (!result->val.boolean) {
+        if (!value_boolean(result)) {
             printf("Test %zu failed:\n", i);
             printf("\tInput:    %s\n", input.text);
             printf("\tExpected: %s\n", output.text);
             printf("\tActual:   ");
-            Value* actual_output = internal_eval(parse_input, &global_env);
+            Value* actual_output = engine_eval(parse_input, global_env);
             value_print(actual_output);
             value_deref(actual_output);
             printf("\n");
@@ -1543,10 +4737,119 @@ int main(int argc, char* argv[]) {
         }
 
         value_deref(to_eval);
+        parser_deinit(&input);
+        parser_deinit(&output);
+    }
+
+}
+
+#ifndef JISP_NO_MAIN
+int main(int argc, char* argv[]) {
+    size_t chunk_values = VP_CHUNK_VALUES;
+    size_t heap_max = VP_MAX_BYTES;
+    // Without a file (or - for stdin) the built in tests are run instead
+    const char* source = NULL;
+    // Runtime counters are written here at exit, see `runtime_stats_write`
+    const char* stats_file = NULL;
+    const char* trace_file = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp("--chunk-size", argv[i]) && i + 1 < argc &&
+            parse_size(argv[i + 1], &chunk_values)) {
+            i++;
+        } else if (!strcmp("--heap-max", argv[i]) && i + 1 < argc &&
+                   parse_size(argv[i + 1], &heap_max)) {
+            i++;
+        } else if (!strcmp("--engine", argv[i]) && i + 1 < argc &&
+                   (!strcmp("tree", argv[i + 1]) ||
+                    !strcmp("vm", argv[i + 1]))) {
+            engine = !strcmp("vm", argv[++i]) ? ENGINE_VM : ENGINE_TREE;
+        } else if (!strcmp("--stats-file", argv[i]) && i + 1 < argc) {
+            stats_file = argv[++i];
+        } else if (!strcmp("--trace", argv[i]) && i + 1 < argc) {
+            // Evaluation spans are written here as Chrome trace events
+            trace_file = argv[++i];
+        } else if (!strcmp("--profile", argv[i])) {
+            // Calls evaluated by the tree walker are timed per name and
+            // reported on stderr at exit
+            global_profiler.enabled = true;
+        } else if (!source && (argv[i][0] != '-' || !strcmp("-", argv[i]))) {
+            source = argv[i];
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--chunk-size values] [--heap-max bytes] "
+                    "[--engine tree|vm] [--profile] [--stats-file path] "
+                    "[--trace path] [file | -]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    int source_fd = -1;
+    bool repl = false;
+    if (source && !strcmp("-", source)) {
+        source_fd = STDIN_FILENO;
+        repl = isatty(STDIN_FILENO);
+    } else if (source && (source_fd = open(source, O_RDONLY)) < 0) {
+        fprintf(stderr, "error: can't open %s: %s\n", source, strerror(errno));
+        return 1;
+    }
+
+    if (trace_file) {
+        FILE* out = fopen(trace_file, "w");
+        if (!out) {
+            fprintf(stderr, "error: can't write %s: %s\n", trace_file,
+                    strerror(errno));
+            return 1;
+        }
+
+        tracer_start(&global_tracer, out);
+    }
+    call_hooks = global_profiler.enabled || global_tracer.enabled;
+
+    global_vp = valuepool_init(chunk_values, heap_max);
+    symbols_init();
+
+    Env global_env;
+    global_env_init(&global_env);
+
+    if (source) {
+        // Files are mapped and parsed in place, stdin is streamed
+        Parser input = source_fd == STDIN_FILENO ? parser_init_fd(source_fd)
+                                                 : parser_init_mmap(source_fd);
+        run_forms(&input, &global_env, repl);
+        parser_deinit(&input);
+
+        if (source_fd != STDIN_FILENO) {
+            close(source_fd);
+        }
+    } else {
+        run_tests(&global_env);
+    }
+
+    if (global_profiler.enabled) {
+        profile_report(stderr);
+    }
+    if (global_tracer.enabled) {
+        tracer_stop(&global_tracer);
+    }
+    if (stats_file) {
+        FILE* out = fopen(stats_file, "w");
+        if (out) {
+            runtime_stats_write(out);
+            fclose(out);
+        } else {
+            fprintf(stderr, "error: can't write %s: %s\n", stats_file,
+                    strerror(errno));
+        }
     }
+    profiler_deinit(&global_profiler);
 
     /* env_print(&global_env); */
     env_deinit(&global_env);
+    vm_deinit(&global_vm);
 
     valuepool_deinit(&global_vp);
+    symbols_deinit();
 }
+#endif
@@ -1,54 +1,213 @@
 #include "main2.h"
+#include "parse_size.h"
 #include <assert.h>
 #include <ctype.h>
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
 /***********/
 /* Globals */
 /***********/
-ValuePool global_vp = (ValuePool){
-    .values = (Value[10000]){}, .used = (bool[10000]){}, .cap = 10000};
+ValuePool global_vp;
+SymbolTable global_symbols;
+
+// Symbols the interpreter itself needs to recognize, registered by
+// `symbols_init` so parsing the same name yields the same pointer
+Symbol symbol_nil = {.name = "nil"};
+Symbol symbol_builtin = {.name = "builtin"};
+Symbol symbol_lambda = {.name = "lambda"};
+Symbol symbol_macro = {.name = "macro"};
+Symbol symbol_string = {.name = "string"};
+Symbol symbol_true = {.name = "#t"};
+Symbol symbol_false = {.name = "#f"};
+Symbol symbol_rest = {.name = "&rest"};
+Symbol symbol_define = {.name = "define", .special_form = eval_define};
+Symbol symbol_progn = {.name = "progn", .special_form = eval_progn};
+Symbol symbol_cond = {.name = "cond", .special_form = eval_cond};
+Symbol symbol_if = {.name = "if", .special_form = eval_if};
+Symbol symbol_and = {.name = "and", .special_form = eval_and};
+Symbol symbol_or = {.name = "or", .special_form = eval_or};
+Symbol symbol_let = {.name = "let", .special_form = eval_let};
+
+/**********/
+/* Symbol */
+/**********/
+// FNV-1a
+uint64_t symbol_hash(const char* name, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 0x100000001b3;
+    }
 
-/*********/
-/* Value */
-/*********/
-void value_ref(Value* v) {
-    switch (v->tag) {
-    case CONS:
-        value_ref(v->val.cons.car);
-        value_ref(v->val.cons.cdr);
-    case NUMBER:
-    case SYMBOL:
-    case POINTER:
-        v->rc++;
-        break;
+    return hash;
+}
+
+Symbol** symboltable_find(const SymbolTable* st, const char* name, size_t len,
+                          uint64_t hash) {
+    size_t mask = st->cap - 1;
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        Symbol** slot = st->slots + i;
+
+        if (!*slot || ((*slot)->hash == hash && (*slot)->len == len &&
+                       !memcmp((*slot)->name, name, len))) {
+            return slot;
+        }
     }
 }
 
+void symboltable_grow(SymbolTable* st) {
+    SymbolTable grown = (SymbolTable){
+        .slots = calloc(st->cap ? st->cap * 2 : 64, sizeof(Symbol*)),
+        .cap = st->cap ? st->cap * 2 : 64,
+        .len = st->len,
+    };
+
+    for (size_t i = 0; i < st->cap; i++) {
+        Symbol* s = st->slots[i];
+
+        if (s) {
+            *symboltable_find(&grown, s->name, s->len, s->hash) = s;
+        }
+    }
+
+    free(st->slots);
+    *st = grown;
+}
+
+// Adds a statically allocated symbol to the table, it must not be interned yet
+void symboltable_register(SymbolTable* st, Symbol* s) {
+    if ((st->len + 1) * 2 > st->cap) {
+        symboltable_grow(st);
+    }
+
+    s->len = strlen(s->name);
+    s->hash = symbol_hash(s->name, s->len);
+
+    Symbol** slot = symboltable_find(st, s->name, s->len, s->hash);
+    assert(!*slot);
+
+    *slot = s;
+    st->len++;
+}
+
+const Symbol* intern_n(const char* name, size_t len) {
+    SymbolTable* st = &global_symbols;
+    if ((st->len + 1) * 2 > st->cap) {
+        symboltable_grow(st);
+    }
+
+    uint64_t hash = symbol_hash(name, len);
+    Symbol** slot = symboltable_find(st, name, len, hash);
+
+    if (!*slot) {
+        // Name is stored inline, right after the symbol itself
+        Symbol* s = malloc(sizeof(Symbol) + len + 1);
+        char* inline_name = (char*)(s + 1);
+
+        memcpy(inline_name, name, len);
+        inline_name[len] = '\0';
+
+        *s = (Symbol){.name = inline_name, .len = len, .hash = hash};
+        *slot = s;
+        st->len++;
+    }
+
+    return *slot;
+}
+
+const Symbol* intern(const char* name) { return intern_n(name, strlen(name)); }
+
+void symbols_init() {
+    Symbol* builtin_symbols[] = {
+        &symbol_nil,    &symbol_builtin, &symbol_lambda, &symbol_macro,
+        &symbol_string, &symbol_true,    &symbol_false,  &symbol_rest,
+        &symbol_define, &symbol_progn,   &symbol_cond,   &symbol_if,
+        &symbol_and,    &symbol_or,      &symbol_let,
+    };
+
+    for (size_t i = 0; i < sizeof(builtin_symbols) / sizeof(*builtin_symbols);
+         i++) {
+        symboltable_register(&global_symbols, builtin_symbols[i]);
+    }
+}
+
+void symbols_deinit() {
+    SymbolTable* st = &global_symbols;
+
+    for (size_t i = 0; i < st->cap; i++) {
+        Symbol* s = st->slots[i];
+
+        // Only interned symbols own their memory, registered ones are static
+        if (s && s->name == (const char*)(s + 1)) {
+            free(s);
+        }
+    }
+
+    free(st->slots);
+    *st = (SymbolTable){0};
+}
+
+/*********/
+/* Value */
+/*********/
+// Refcounts are shallow, a cons cell owns one reference to its car and cdr
+// which it only releases when it is freed itself
+void value_ref(Value* v) { v->rc++; }
+
+// One child is released by looping rather than recursing, the cdr unless
+// only the car is a cons cell, so freeing long lists and deeply nested ones
+// doesn't grow the C stack. A closure or macro releases its body the same way,
+// and a symbol the closure compiled from the list it heads.
 void value_deref(Value* v) {
-    assert(v->rc > 0);
-    switch (v->tag) {
-    case CONS:
-        value_deref(v->val.cons.car);
-        value_deref(v->val.cons.cdr);
-    case NUMBER:
-    case SYMBOL:
-    case POINTER:
+    while (v) {
+        assert(v->rc > 0);
+
         v->rc--;
-        break;
-    }
+        if (v->rc > 0) {
+            return;
+        }
+
+        Value* next = NULL;
+        if (v->tag == BUILTIN || v->tag == CLOSURE || v->tag == MACRO) {
+            Procedure* p = v->val.procedure;
+            next = v->tag == BUILTIN ? NULL : p->body;
+
+            free(p->params);
+            free(p);
+        } else if (v->tag == CONS) {
+            Value* car = v->val.cons.car;
+            Value* cdr = v->val.cons.cdr;
+
+            if (cdr->tag != CONS && car->tag == CONS) {
+                next = car;
+                car = cdr;
+            } else {
+                next = cdr;
+            }
+
+            value_deref(car);
+        } else if (v->tag == SYMBOL) {
+            next = v->val.closure;
+        }
 
-    if (v->rc == 0) {
         valuepool_free(&global_vp, v);
+        v = next;
     }
 }
 
 Value* value_clone(const Value* v) {
-    if (v->tag == CONS) {
+    // Conses and procedures are never modified, so they're shared
+    if (v->tag == CONS || v->tag == BUILTIN || v->tag == CLOSURE ||
+        v->tag == MACRO) {
         value_ref((Value*)v);
         return (Value*)v;
     }
@@ -65,9 +224,12 @@ Value* value_clone(const Value* v) {
         ret->val.pointer = v->val.pointer;
         break;
     case SYMBOL:
-        ret->val.string = strdup(v->val.string);
+        ret->val.symbol = v->val.symbol;
         break;
     case CONS:
+    case BUILTIN:
+    case CLOSURE:
+    case MACRO:
         assert(false);
     }
 
@@ -84,11 +246,20 @@ void _value_print(const Value* v) {
         printf("%g", v->val.number);
         break;
     case SYMBOL:
-        printf("%s", v->val.string);
+        printf("%s", v->val.symbol->name);
         break;
     case POINTER:
         printf("%p", v->val.pointer);
         break;
+    case BUILTIN:
+        printf("#builtin");
+        break;
+    case CLOSURE:
+        printf("#closure");
+        break;
+    case MACRO:
+        printf("#macro");
+        break;
     case CONS:
         printf("(");
         const Value* current = v;
@@ -119,34 +290,25 @@ void value_print(const Value* v) {
 
 bool value_isnil(const Value* v) {
     assert(v);
-    return v->tag == SYMBOL && !strcmp("nil", v->val.string);
+    return v->tag == SYMBOL && v->val.symbol == &symbol_nil;
 }
 
 bool value_truthy(const Value* v) {
     return !((v->tag == NUMBER && v->val.number == 0) ||
              (v->tag == POINTER && v->val.pointer == NULL) ||
              (v->tag == SYMBOL &&
-              (!strcmp("#f", v->val.string) || value_isnil(v))) ||
+              (v->val.symbol == &symbol_false || value_isnil(v))) ||
              (v->tag == CONS && value_isnil(v->val.cons.car) &&
               value_isnil(v->val.cons.cdr)));
 }
 
+// Special forms are registered symbols, parsing any other name interns a
+// symbol without a handler
 specialform value_isspecialform(const Value* v) {
     assert(v);
     assert(v->tag == SYMBOL);
 
-    const char* specialform_keywords[] = {"define", "progn", "cond"};
-    const specialform specialform_ptrs[] = {eval_define, eval_progn, eval_cond};
-
-    for (size_t i = 0;
-         i < sizeof(specialform_keywords) / sizeof(*specialform_keywords);
-         i++) {
-        if (!strcmp(v->val.string, specialform_keywords[i])) {
-            return specialform_ptrs[i];
-        }
-    }
-
-    return NULL;
+    return v->val.symbol->special_form;
 }
 
 Value* _cons(Value* a, Value* b, bool increase_ref) {
@@ -176,7 +338,7 @@ Value* _cdr(Value* v, Env* env) {
     assert(v->tag == CONS);
 
     if (value_isnil(v->val.cons.cdr)) {
-        return env_get(env, "nil");
+        return env_get(env, &symbol_nil);
     }
 
     value_ref(v->val.cons.cdr);
@@ -190,7 +352,7 @@ bool _symbol_eq(const Value* a, const Value* b) {
     assert(a->tag == SYMBOL);
     assert(b->tag == SYMBOL);
 
-    return !strcmp(a->val.string, b->val.string);
+    return a->val.symbol == b->val.symbol;
 }
 
 // (symbol-eq 'a 'b)
@@ -210,7 +372,7 @@ Value* symbol_eq(Value* v, struct Env* env) {
     assert(a->tag == SYMBOL);
     assert(b->tag == SYMBOL);
 
-    Value* ret = env_get(env, _symbol_eq(a, b) ? "#t" : "#f");
+    Value* ret = env_get(env, _symbol_eq(a, b) ? &symbol_true : &symbol_false);
 
     value_deref(a);
     value_deref(rest);
@@ -223,61 +385,226 @@ Value* symbol_eq(Value* v, struct Env* env) {
 /*************/
 /* ValuePool */
 /*************/
-Value* valuepool_alloc(ValuePool* vp) {
-    assert(vp->in_use < vp->cap);
+ValuePool valuepool_init(size_t chunk_values, size_t max_bytes) {
+    size_t per_value = sizeof(Value) + sizeof(bool);
+    size_t overhead = sizeof(ValueChunk) + alignof(Value);
+
+    // Chunk sizes are doubled from a power of two, none fits past SIZE_MAX / 2
+    if (chunk_values > (SIZE_MAX - overhead) / per_value ||
+        overhead + chunk_values * per_value > SIZE_MAX / 2 + 1) {
+        fprintf(stderr, "error: a chunk can't hold %zu values\n",
+                chunk_values);
+        exit(1);
+    }
+
+    size_t chunk_size = VP_MIN_CHUNK_SIZE;
+    while (chunk_size < overhead + chunk_values * per_value) {
+        chunk_size *= 2;
+    }
+
+    size_t max_chunks = max_bytes / chunk_size;
+
+    return (ValuePool){
+        .chunk_size = chunk_size,
+        .chunk_cap = (chunk_size - overhead) / per_value,
+        .max_chunks = max_chunks ? max_chunks : 1,
+    };
+}
+
+void valuechunk_unlink(ValueChunk** head, ValueChunk* c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        *head = c->next;
+    }
+
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+
+    c->prev = NULL;
+    c->next = NULL;
+}
 
-    for (size_t i = 0; i < vp->cap; i++) {
-        if (!vp->used[i]) {
-            vp->used[i] = true;
-            vp->values[i] = (Value){.rc = 1};
-            vp->in_use++;
+void valuechunk_push(ValueChunk** head, ValueChunk* c) {
+    c->prev = NULL;
+    c->next = *head;
+
+    if (*head) {
+        (*head)->prev = c;
+    }
 
-            if (vp->in_use > vp->high_water) {
-                vp->high_water = vp->in_use;
+    *head = c;
+}
+
+ValueChunk* valuechunk_map(const ValuePool* vp) {
+    // Over-map by a whole chunk so an aligned window is guaranteed to fit,
+    // then hand the slop on either side straight back
+    size_t size = vp->chunk_size;
+    char* raw = mmap(NULL, size * 2, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return NULL;
+    }
+
+    char* aligned =
+        (char*)(((uintptr_t)raw + size - 1) & ~(uintptr_t)(size - 1));
+    if (aligned != raw) {
+        munmap(raw, aligned - raw);
+    }
+    if (aligned + size != raw + size * 2) {
+        munmap(aligned + size, (raw + size * 2) - (aligned + size));
+    }
+
+    // Fresh mappings are zero filled, so used starts out all false
+    ValueChunk* c = (ValueChunk*)aligned;
+    c->used = (bool*)(c + 1);
+    uintptr_t values = (uintptr_t)(c->used + vp->chunk_cap);
+    c->values = (Value*)((values + alignof(Value) - 1) &
+                         ~(uintptr_t)(alignof(Value) - 1));
+    c->cap = vp->chunk_cap;
+
+    return c;
+}
+
+void valuechunk_unmap(const ValuePool* vp, ValueChunk* c) {
+    munmap(c, vp->chunk_size);
+}
+
+Value* valuepool_alloc(ValuePool* vp) {
+    if (!vp->available) {
+        ValueChunk* c = vp->spare;
+        vp->spare = NULL;
+
+        if (!c) {
+            if (vp->chunks >= vp->max_chunks ||
+                !(c = valuechunk_map(vp))) {
+                fprintf(stderr,
+                        "error: value heap exhausted, %zu chunks of %zu "
+                        "bytes in use\n",
+                        vp->chunks, vp->chunk_size);
+                exit(1);
             }
 
-            return vp->values + i;
+            vp->chunks++;
         }
+
+        valuechunk_push(&vp->available, c);
     }
 
-    assert(false);
+    ValueChunk* c = vp->available;
+    Value* ret = NULL;
+    if (c->free_list) {
+        ret = c->free_list;
+        c->free_list = ret->val.next_free;
+    } else {
+        // This chunk has no freed slots, so every one below its high_water
+        // is live
+        assert(c->high_water < c->cap);
+        ret = c->values + c->high_water++;
+    }
+
+    ptrdiff_t offset = ret - c->values;
+    assert(!c->used[offset]);
+
+    c->used[offset] = true;
+    *ret = (Value){.rc = 1};
+    c->in_use++;
+
+    if (c->in_use == c->cap) {
+        valuechunk_unlink(&vp->available, c);
+        valuechunk_push(&vp->full, c);
+    }
+
+    vp->in_use++;
+    if (vp->in_use > vp->high_water) {
+        vp->high_water = vp->in_use;
+    }
+
+    return ret;
 }
 
 void valuepool_free(ValuePool* vp, Value* v) {
-    ptrdiff_t offset = v - vp->values;
-    assert(offset < vp->cap);
-    assert(vp->used[offset]);
-    assert(vp->values[offset].rc == 0);
+    ValueChunk* c =
+        (ValueChunk*)((uintptr_t)v & ~(uintptr_t)(vp->chunk_size - 1));
+    ptrdiff_t offset = v - c->values;
+    assert(offset >= 0 && (size_t)offset < c->cap);
+    assert(c->used[offset]);
+    assert(v->rc == 0);
 
-    switch (vp->values[offset].tag) {
+    switch (v->tag) {
     case NUMBER:
         break;
     case POINTER:
         break;
     case SYMBOL:
-        free(vp->values[offset].val.string);
+        break;
     case CONS:
         break;
+    case BUILTIN:
+    case CLOSURE:
+    case MACRO:
+        // `value_deref` already released the procedure
+        break;
     }
 
-    vp->used[offset] = false;
+    c->used[offset] = false;
+    v->val.next_free = c->free_list;
+    c->free_list = v;
+
+    if (c->in_use == c->cap) {
+        valuechunk_unlink(&vp->full, c);
+        valuechunk_push(&vp->available, c);
+    }
+
+    c->in_use--;
     vp->in_use--;
-}
 
-void valuepool_deinit(const ValuePool* vp) {
-    for (size_t i = 0; i < vp->cap; i++) {
-        assert(!vp->used[i]);
+    if (c->in_use == 0) {
+        valuechunk_unlink(&vp->available, c);
+
+        if (vp->spare) {
+            valuechunk_unmap(vp, c);
+            vp->chunks--;
+        } else {
+            vp->spare = c;
+        }
     }
+}
 
+void valuepool_deinit(ValuePool* vp) {
     assert(vp->in_use == 0);
+
+    // Every chunk is empty, so they can only be sitting in these two places
+    assert(vp->full == NULL);
+    while (vp->available) {
+        ValueChunk* c = vp->available;
+        valuechunk_unlink(&vp->available, c);
+        valuechunk_unmap(vp, c);
+    }
+    if (vp->spare) {
+        valuechunk_unmap(vp, vp->spare);
+        vp->spare = NULL;
+    }
 }
 
-void valuepool_print(const ValuePool* vp) {
-    for (size_t i = 0; i < vp->high_water; i++) {
-        printf("%4d | ", vp->values[i].rc);
-        _value_print(&vp->values[i]);
-        printf("\n");
+void valuechunk_print(const ValueChunk* c) {
+    for (; c; c = c->next) {
+        for (size_t i = 0; i < c->high_water; i++) {
+            if (!c->used[i]) {
+                continue;
+            }
+
+            printf("%4d | ", c->values[i].rc);
+            _value_print(&c->values[i]);
+            printf("\n");
+        }
     }
+}
+
+void valuepool_print(const ValuePool* vp) {
+    valuechunk_print(vp->full);
+    valuechunk_print(vp->available);
     fflush(stdout);
 }
 
@@ -295,7 +622,6 @@ Env env_init(size_t size, Env* parent) {
 
 void env_deinit(Env* e) {
     for (size_t i = 0; i < e->len; i++) {
-        free(e->keys[i]);
         value_deref(e->vals[i]);
     }
 
@@ -303,9 +629,9 @@ void env_deinit(Env* e) {
     free(e->vals);
 }
 
-Value* env_get(const Env* e, const char* key) {
+Value* env_get(const Env* e, const Symbol* key) {
     for (size_t i = 0; i < e->len; i++) {
-        if (!strcmp(key, e->keys[i])) {
+        if (key == e->keys[i]) {
             value_ref(e->vals[i]);
             return e->vals[i];
         }
@@ -314,15 +640,15 @@ Value* env_get(const Env* e, const char* key) {
     if (e->parent) {
         return env_get(e->parent, key);
     } else {
-        return env_get(e, "nil");
+        return env_get(e, &symbol_nil);
     }
 }
 
 // Same thing as above, but returns a constant reference, and does not increment
 // it's rc
-const Value* env_get_const(const Env* e, const char* key) {
+const Value* env_get_const(const Env* e, const Symbol* key) {
     for (size_t i = 0; i < e->len; i++) {
-        if (!strcmp(key, e->keys[i])) {
+        if (key == e->keys[i]) {
             return e->vals[i];
         }
     }
@@ -330,17 +656,17 @@ const Value* env_get_const(const Env* e, const char* key) {
     if (e->parent) {
         return env_get_const(e->parent, key);
     } else {
-        return env_get_const(e, "nil");
+        return env_get_const(e, &symbol_nil);
     }
 }
 
-void env_put(Env* e, const char* key, Value* val, bool increase_ref) {
+void env_put(Env* e, const Symbol* key, Value* val, bool increase_ref) {
     if (increase_ref) {
         value_ref(val);
     }
 
     for (size_t i = 0; i < e->len; i++) {
-        if (!strcmp(key, e->keys[i])) {
+        if (key == e->keys[i]) {
             value_deref(e->vals[i]);
             e->vals[i] = val;
 
@@ -355,7 +681,7 @@ void env_put(Env* e, const char* key, Value* val, bool increase_ref) {
     }
 
     assert(e->len < e->cap);
-    e->keys[e->len] = strdup(key);
+    e->keys[e->len] = key;
     e->vals[e->len] = val;
     e->len++;
 
@@ -377,78 +703,181 @@ void parser_skip_whitespace(Parser* p) {
     }
 }
 
-Value* parse(Parser* p, Env* e) {
-    parser_skip_whitespace(p);
+Value* parse_atom(Parser* p) {
+    char buf[256] = {0};
 
-    if (parser_peek(p) == '\'') {
-        parser_get(p);
+    for (int i = 0;
+         parser_peek(p) != ')' && parser_peek(p) != ' ' && p->pos < p->len;
+         i++) {
+        buf[i] = parser_get(p);
+    }
 
-        Value* v = parse(p, e);
-        v->quoted++;
+    Value* ret = valuepool_alloc(&global_vp);
+    if (buf[0] == '0' && buf[1] == 'x') {
+        ret->tag = POINTER;
 
-        return v;
-    } else if (parser_peek(p) != '(') {
-        assert(parser_peek(p) != '\'');
-        char buf[256] = {0};
-
-        for (int i = 0;
-             parser_peek(p) != ')' && parser_peek(p) != ' ' && p->pos < p->len;
-             i++) {
-            buf[i] = parser_get(p);
-        }
+        ret->val.pointer = (void*)strtoull(buf, NULL, 0);
+    } else if (isdigit(buf[0]) || buf[0] == '-') {
+        ret->tag = NUMBER;
 
-        Value* ret = valuepool_alloc(&global_vp);
-        if (buf[0] == '0' && buf[1] == 'x') {
-            ret->tag = POINTER;
+        ret->val.number = strtod(buf, NULL);
+    } else {
+        ret->tag = SYMBOL;
 
-            ret->val.pointer = (void*)strtoull(buf, NULL, 0);
-        } else if (isdigit(buf[0]) || buf[0] == '-') {
-            ret->tag = NUMBER;
+        ret->val.symbol = intern(buf);
+    }
 
-            ret->val.number = strtod(buf, NULL);
-        } else {
-            ret->tag = SYMBOL;
+    return ret;
+}
 
-            ret->val.string = strdup(buf);
-        }
+// A quote or a list still waiting on values. A list keeps its first and last
+// cons cell so each element is appended in place.
+typedef struct ParseFrame {
+    bool quote;
+    Value* head;
+    Value* last;
+} ParseFrame;
 
-        return ret;
-    } else {
-        // '('
-        parser_get(p);
+// Open forms are kept on an explicit stack, spilling to the heap when they
+// nest deeper than the one on the C stack, so depth only costs a frame each
+Value* parse(Parser* p, Env* e) {
+    ParseFrame local[32];
+    ParseFrame* stack = local;
+    size_t len = 0;
+    size_t cap = sizeof(local) / sizeof(*local);
+
+    while (true) {
         parser_skip_whitespace(p);
 
-        // Early out for empty list
-        if (parser_peek(p) == ')') {
-            parser_get(p);
-            return env_get(e, "nil");
+        Value* v = NULL;
+        if (parser_peek(p) == '\'' || parser_peek(p) == '(') {
+            if (len == cap) {
+                cap *= 2;
+                if (stack == local) {
+                    stack = malloc(sizeof(*stack) * cap);
+                    memcpy(stack, local, sizeof(local));
+                } else {
+                    stack = realloc(stack, sizeof(*stack) * cap);
+                }
+            }
+
+            if (parser_get(p) == '\'') {
+                stack[len++] = (ParseFrame){.quote = true};
+                continue;
+            }
+
+            parser_skip_whitespace(p);
+
+            // Early out for empty list
+            if (parser_peek(p) == ')') {
+                parser_get(p);
+                v = env_get(e, &symbol_nil);
+            } else {
+                stack[len++] = (ParseFrame){0};
+                continue;
+            }
+        } else {
+            v = parse_atom(p);
         }
 
-        // We're parsing a list
-        // I'm cheating and getting the first element to make the follwing loop
-        // not hurt my brain quite so much
-        Value* v = _cons(parse(p, e), env_get(e, "nil"), false);
+        // Hand the value to the forms waiting on it, closing the ones it
+        // completes
+        while (len > 0) {
+            ParseFrame* top = &stack[len - 1];
 
-        Value* current_cons = v;
-        while (parser_peek(p) != ')' && p->pos < p->len) {
-            Value* next_cons = _cons(parse(p, e), env_get(e, "nil"), false);
+            if (top->quote) {
+                v->quoted++;
+                len--;
+                continue;
+            }
 
-            value_deref(current_cons->val.cons.cdr);
-            current_cons->val.cons.cdr = next_cons;
+            Value* next_cons = _cons(v, env_get(e, &symbol_nil), false);
+            if (top->head) {
+                value_deref(top->last->val.cons.cdr);
+                top->last->val.cons.cdr = next_cons;
+            } else {
+                top->head = next_cons;
+            }
+            top->last = next_cons;
 
-            current_cons = next_cons;
+            if (parser_peek(p) != ')' && p->pos < p->len) {
+                break;
+            }
+
+            parser_skip_whitespace(p);
+            parser_get(p); // ')'
+
+            v = top->head;
+            len--;
         }
 
-        parser_skip_whitespace(p);
-        parser_get(p); // ')'
+        if (len == 0) {
+            if (stack != local) {
+                free(stack);
+            }
 
-        return v;
+            return v;
+        }
     }
 }
 
 /********/
 /* Eval */
 /********/
+// Binds the arguments of a call to `p`, headed by `name`, into `frame`.
+// They're evaluated in `env` first unless they're a macro's, which binds the
+// rest of its arguments unevaluated too.
+void procedure_bind(const Procedure* p, const Value* name, Value* args,
+                    Env* env, Env* frame, bool evaluate) {
+    size_t argc = 0;
+    for (const Value* arg = args; arg->tag == CONS; arg = arg->val.cons.cdr) {
+        argc++;
+    }
+
+    if (argc != p->required && !(p->rest && argc > p->required)) {
+        fprintf(stderr,
+                "error: attempting to call %s with %zu arguments, expects "
+                "%s%zu\n",
+                name->tag == SYMBOL ? name->val.symbol->name : "a lambda",
+                argc, p->rest ? "at least " : "", p->required);
+        assert(false);
+    }
+
+    for (size_t i = 0; i < p->required; i++) {
+        Value* arg = args->val.cons.car;
+        if (evaluate) {
+            arg = _eval(arg, env);
+        } else {
+            value_ref(arg);
+        }
+
+        env_put(frame, p->params[i], arg, false);
+        args = args->val.cons.cdr;
+    }
+
+    if (!p->rest) {
+        return;
+    }
+
+    Value* rest = NULL;
+    if (evaluate) {
+        // Each cell takes over the terminating nil from the one before it
+        rest = env_get(env, &symbol_nil);
+        Value** tail = &rest;
+
+        for (; args->tag == CONS; args = args->val.cons.cdr) {
+            Value* cell = _cons(_eval(args->val.cons.car, env), *tail, false);
+            *tail = cell;
+            tail = &cell->val.cons.cdr;
+        }
+    } else {
+        value_ref(args);
+        rest = args;
+    }
+
+    env_put(frame, p->params[p->required], rest, false);
+}
+
 // (+ 1 2 3)
 Value* _eval(Value* v, Env* env) {
     if (v->quoted) {
@@ -466,181 +895,83 @@ Value* _eval(Value* v, Env* env) {
         value_ref(v);
         return v;
     case SYMBOL:
-        return env_get(env, v->val.string);
+        return env_get(env, v->val.symbol);
     case CONS: {
-        Value* ret = NULL;
-
-        Value* first = _car(v, env);
-        assert(first->tag == SYMBOL);
-
-        Value* args = _cdr(v, env);
-        assert(args->tag == CONS);
-
-        specialform sf = NULL;
-        if ((sf = value_isspecialform(first))) {
-            Value* sf_result = sf(args, env);
+        // The call form holds on to its head and arguments for as long as
+        // the call runs, so they're only borrowed
+        Value* first = v->val.cons.car;
+        Value* args = v->val.cons.cdr;
+        Value* procedure = NULL;
+
+        if (first->tag == SYMBOL) {
+            // (lambda (a b) (+ a b)), compiled once and kept on its head
+            if (first->val.symbol == &symbol_lambda) {
+                return make_closure(v);
+            }
 
-            value_deref(first);
-            value_deref(args);
+            specialform sf = NULL;
+            if ((sf = value_isspecialform(first))) {
+                return sf(args, env);
+            }
 
-            return sf_result;
+            procedure = env_get(env, first->val.symbol);
+        } else {
+            // Like ((lambda (x) x) 1)
+            procedure = _eval(first, env);
         }
 
-        Value* symbol = env_get(env, first->val.string);
-        assert(symbol->tag == CONS);
-
-        Value* symbol_first = _car(symbol, env);
-        assert(symbol_first->tag == SYMBOL);
-
-        if (_symbol_eq(symbol_first, env_get_const(env, "builtin")) ||
-            _symbol_eq(symbol_first, env_get_const(env, "lambda"))) {
-            // (builtin '(arg1 arg2 ... argN) 0xFFFF)
-            // (lambda '(arg1 arg2 ... argN) body)
-            Value* rest = _cdr(symbol, env); // ((arg1 arg2 ... argN) 0xFFFF)
-            Value* arg_names = _car(rest, env);
-            Value* body_or_ptr_cons = _cdr(rest, env); // (0xFFFF)
-            Value* body_or_ptr = _car(body_or_ptr_cons, env);
-            assert(arg_names->tag == CONS);
-            assert(body_or_ptr_cons->tag == CONS);
-
-            Env funcall_env = env_init(10, env);
-
-            while (!value_isnil(args) && !value_isnil(arg_names)) {
-                Value* arg_name = _car(arg_names, env);
-                assert(arg_name->tag == SYMBOL);
-
-                if (_symbol_eq(arg_name, env_get_const(env, "&rest"))) {
-                    // Signal to skip to next arg name and bind all remaining
-                    // args to it as a list
-                    value_deref(arg_name);
-                    Value* rest = _cdr(arg_names, env);
-                    value_deref(arg_names);
-                    arg_names = rest;
-
-                    arg_name = _car(arg_names, env);
-                    assert(arg_name->tag == SYMBOL);
-
-                    // Now we need to eval the rest of the args into a list
-                    Value* rest_arg_list = NULL;
-                    Value* rest_arg_list_first = NULL;
-
-                    while (!value_isnil(args)) {
-                        Value* head = _car(args, env);
-                        Value* next_cons =
-                            _cons(_eval(head, env), env_get(env, "nil"), false);
-                        value_deref(head);
-
-                        if (rest_arg_list == NULL) {
-                            rest_arg_list = next_cons;
-                            rest_arg_list_first = next_cons;
-                        } else {
-                            value_deref(rest_arg_list->val.cons.cdr);
-                            rest_arg_list->val.cons.cdr = next_cons;
-                            rest_arg_list = next_cons;
-                        }
-
-                        Value* rest_args = _cdr(args, env);
-                        value_deref(args);
-                        args = rest_args;
-                    }
-
-                    env_put(&funcall_env, arg_name->val.string,
-                            rest_arg_list_first, false);
-
-                    value_deref(arg_name);
-
-                    break;
-                }
+        // A quoted (lambda ...) or (macro ...) passed around as a value,
+        // like eval_define does for one being defined. Only the first call
+        // through a given list compiles it.
+        Value* compiled = make_closure(procedure);
+        if (compiled) {
+            value_deref(procedure);
+            procedure = compiled;
+        }
+        Procedure* p = procedure->val.procedure;
+        Value* ret = NULL;
 
-                Value* arg_value = _car(args, env);
-                env_put(&funcall_env, arg_name->val.string,
-                        _eval(arg_value, env), false);
-                value_deref(arg_value);
-                value_deref(arg_name);
-
-                Value* rest_args = _cdr(args, env);
-                Value* rest_names = _cdr(arg_names, env);
-                value_deref(args);
-                value_deref(arg_names);
-                args = rest_args;
-                arg_names = rest_names;
-            }
+        switch (procedure->tag) {
+        case BUILTIN:
+        case CLOSURE: {
+            // Room for a rest list too, and never empty
+            Env funcall_env = env_init(p->required + 1, env);
+            procedure_bind(p, first, args, env, &funcall_env, true);
 
-            if (_symbol_eq(symbol_first, env_get_const(env, "builtin"))) {
-                builtin builtin_ptr = body_or_ptr->val.pointer;
-                ret = builtin_ptr(&funcall_env);
-            } else if (_symbol_eq(symbol_first, env_get_const(env, "lambda"))) {
-                ret = _eval(body_or_ptr, &funcall_env);
+            if (procedure->tag == BUILTIN) {
+                ret = p->func(&funcall_env);
+            } else {
+                ret = _eval(p->body, &funcall_env);
             }
 
             env_deinit(&funcall_env);
-            value_deref(arg_names);
-            value_deref(body_or_ptr);
-            value_deref(body_or_ptr_cons);
-            value_deref(rest);
-        } else if (_symbol_eq(symbol_first, env_get_const(env, "macro"))) {
-            // (macro '(arg1 arg2 ... argN) (body))
-            Value* rest = _cdr(symbol, env); // ((arg1 arg2 ... argN) (body))
-            Value* arg_names = _car(rest, env);
-            Value* body_cons = _cdr(rest, env); // (body)
-            Value* body = _car(body_cons, env);
-            assert(arg_names->tag == CONS);
-            assert(body_cons->tag == CONS);
-
-            Env macro_env = env_init(10, env);
-
-            while (!value_isnil(args) && !value_isnil(arg_names)) {
-                Value* arg_name = _car(arg_names, env);
-                assert(arg_name->tag == SYMBOL);
-
-                if (_symbol_eq(arg_name, env_get_const(env, "&rest"))) {
-                    // Signal to skip to next arg name and bind all remaining
-                    // args to it as a list
-                    value_deref(arg_name);
-                    Value* rest = _cdr(arg_names, env);
-                    value_deref(arg_names);
-                    arg_names = rest;
-
-                    arg_name = _car(arg_names, env);
-                    assert(arg_name->tag == SYMBOL);
-
-                    env_put(&macro_env, arg_name->val.string, rest, false);
-
-                    value_deref(arg_name);
-
-                    break;
-                }
-
-                env_put(&macro_env, arg_name->val.string, _car(args, env),
-                        false);
-                value_deref(arg_name);
+        } break;
+        case MACRO: {
+            // Room for a rest list too, and never empty
+            Env macro_env = env_init(p->required + 1, env);
+            procedure_bind(p, first, args, env, &macro_env, false);
 
-                Value* rest_args = _cdr(args, env);
-                Value* rest_names = _cdr(arg_names, env);
-                value_deref(args);
-                value_deref(arg_names);
-                args = rest_args;
-                arg_names = rest_names;
-            }
-
-            Value* expanded_form = _eval(body, &macro_env);
+            Value* expanded_form = _eval(p->body, &macro_env);
             ret = _eval(expanded_form, env);
 
             env_deinit(&macro_env);
             value_deref(expanded_form);
-            value_deref(arg_names);
-            value_deref(body);
-            value_deref(body_cons);
-            value_deref(rest);
+        } break;
+        default:
+            fprintf(stderr, "error: attempting to call a non procedure\n");
+            assert(false);
         }
 
-        value_deref(symbol_first);
-        value_deref(symbol);
-        value_deref(args);
-        value_deref(first);
+        // Held until now in case the call redefined it
+        value_deref(procedure);
 
         return ret;
     } break;
+    case BUILTIN:
+    case CLOSURE:
+    case MACRO:
+        value_ref(v);
+        return v;
     }
 }
 
@@ -657,7 +988,15 @@ Value* eval_define(Value* v, Env* env) {
     Value* expr = _car(rest, env);
     Value* evaluated = _eval(expr, env);
 
-    env_put(env, symbol->val.string, evaluated, true);
+    // Procedures are compiled once here, rather than picked apart on every
+    // call
+    Value* compiled = make_closure(evaluated);
+    if (compiled) {
+        value_deref(evaluated);
+        evaluated = compiled;
+    }
+
+    env_put(env, symbol->val.symbol, evaluated, true);
 
     value_deref(symbol);
     value_deref(rest);
@@ -743,20 +1082,109 @@ Value* eval_cond(Value* v, Env* env) {
     }
 
     if (ret == NULL) {
-        ret = env_get(env, "nil");
+        ret = env_get(env, &symbol_nil);
     }
 
     assert(ret != NULL);
     return ret;
 }
 
+// (if (< 4 5) "yes" "no")
+// ((< 4 5) "yes" "no")
+Value* eval_if(Value* v, Env* env) {
+    assert(v);
+    assert(v->tag == CONS);
+
+    Value* branches = v->val.cons.cdr;
+    assert(branches->tag == CONS && branches->val.cons.cdr->tag == CONS);
+
+    Value* condition_evaled = _eval(v->val.cons.car, env);
+    bool truthy = value_truthy(condition_evaled);
+    value_deref(condition_evaled);
+
+    return _eval(truthy ? branches->val.cons.car
+                        : branches->val.cons.cdr->val.cons.car,
+                 env);
+}
+
+// (and a b ...), #f as soon as one of them is false and #t otherwise
+Value* eval_and(Value* v, Env* env) {
+    for (; v->tag == CONS; v = v->val.cons.cdr) {
+        Value* result = _eval(v->val.cons.car, env);
+        bool truthy = value_truthy(result);
+        value_deref(result);
+
+        if (!truthy) {
+            return env_get(env, &symbol_false);
+        }
+    }
+
+    return env_get(env, &symbol_true);
+}
+
+// (or a b ...), #t as soon as one of them is true and #f otherwise
+Value* eval_or(Value* v, Env* env) {
+    for (; v->tag == CONS; v = v->val.cons.cdr) {
+        Value* result = _eval(v->val.cons.car, env);
+        bool truthy = value_truthy(result);
+        value_deref(result);
+
+        if (truthy) {
+            return env_get(env, &symbol_true);
+        }
+    }
+
+    return env_get(env, &symbol_false);
+}
+
+// (let ((x 1) (y 2)) (+ x y))
+// (((x 1) (y 2)) (+ x y))
+Value* eval_let(Value* v, Env* env) {
+    assert(v);
+    assert(v->tag == CONS);
+
+    Value* bindings = v->val.cons.car;
+    Value* body = v->val.cons.cdr;
+    assert(body->tag == CONS);
+
+    size_t len = 0;
+    for (const Value* b = bindings; b->tag == CONS; b = b->val.cons.cdr) {
+        len++;
+    }
+
+    Env let_env = env_init(len + 1, env);
+
+    for (; bindings->tag == CONS; bindings = bindings->val.cons.cdr) {
+        Value* binding = bindings->val.cons.car; // (x 1)
+        assert(binding->tag == CONS && binding->val.cons.car->tag == SYMBOL);
+        assert(binding->val.cons.cdr->tag == CONS);
+
+        // Evaluated in the enclosing env, like a call's arguments
+        env_put(&let_env, binding->val.cons.car->val.symbol,
+                _eval(binding->val.cons.cdr->val.cons.car, env), false);
+    }
+
+    Value* ret = _eval(body->val.cons.car, &let_env);
+    env_deinit(&let_env);
+
+    return ret;
+}
+
 /************/
 /* Builtins */
 /************/
+// A builtin's argument for its parameter `i`. procedure_bind fills a fresh
+// frame in parameter order, so nothing is looked up by name.
+Value* builtin_arg(const Env* frame, size_t i) {
+    assert(i < frame->len);
+    return frame->vals[i];
+}
+
 // (plus &rest numbers)
 Value* plus(Env* env) {
     // We take in a list of numbers, add them up
-    Value* nums = env_get(env, "numbers");
+    Value* nums = builtin_arg(env, 0);
+    value_ref(nums);
     assert(nums->tag == CONS);
 
     double acc = 0;
@@ -784,57 +1212,35 @@ Value* plus(Env* env) {
 // (eq a b)
 // Only for numbers for now
 Value* eq(Env* env) {
-    const Value* a = env_get_const(env, "a");
-    const Value* b = env_get_const(env, "b");
+    const Value* a = builtin_arg(env, 0);
+    const Value* b = builtin_arg(env, 1);
 
     assert(a->tag == NUMBER);
     assert(b->tag == NUMBER);
 
-    return env_get(env, a->val.number == b->val.number ? "#t" : "#f");
+    return env_get(env, a->val.number == b->val.number ? &symbol_true
+                                                       : &symbol_false);
 }
 
 // (car list)
-Value* car(Env* env) {
-    Value* list = env_get(env, "list");
-    Value* ret = _car(list, env);
-
-    value_deref(list);
-    return ret;
-}
+Value* car(Env* env) { return _car(builtin_arg(env, 0), env); }
 
 // (cdr list)
-Value* cdr(Env* env) {
-    Value* list = env_get(env, "list");
-    Value* ret = _cdr(list, env);
-
-    value_deref(list);
-    return ret;
-}
+Value* cdr(Env* env) { return _cdr(builtin_arg(env, 0), env); }
 
 // (cons a b)
 Value* cons(Env* env) {
-    Value* a = env_get(env, "a");
-    Value* b = env_get(env, "b");
-    Value* ret = _cons(a, b, false);
-
-    return ret;
+    // The new cell takes references of its own, the frame keeps its
+    return _cons(builtin_arg(env, 0), builtin_arg(env, 1), true);
 }
 
 // (eval form)
-Value* eval(Env* env) {
-    Value* form = env_get(env, "form");
-
-    Value* ret = _eval(form, env);
-
-    value_deref(form);
-
-    return ret;
-}
+Value* eval(Env* env) { return _eval(builtin_arg(env, 0), env); }
 
 Value* make_symbol(const char* name) {
     Value* v = valuepool_alloc(&global_vp);
     v->tag = SYMBOL;
-    v->val.string = strdup(name);
+    v->val.symbol = intern(name);
 
     return v;
 }
@@ -844,44 +1250,132 @@ void setup_symbols(Env* e) {
                              "string", "#t",      "#f",     "&rest"};
 
     for (size_t i = 0; i < sizeof(symbols) / sizeof(*symbols); i++) {
-        env_put(e, symbols[i], make_symbol(symbols[i]), false);
+        env_put(e, intern(symbols[i]), make_symbol(symbols[i]), false);
     }
 }
 
-Value* make_builtin(Env* e, char* args[], size_t args_len, builtin func_ptr) {
-    char buf[512] = {0};
-    char* buf_ptr = buf;
+Value* make_procedure(Tag tag, Procedure* p) {
+    Value* ret = valuepool_alloc(&global_vp);
+    ret->tag = tag;
+    ret->val.procedure = p;
+
+    return ret;
+}
+
+Value* make_builtin(char* args[], size_t args_len, builtin func_ptr) {
+    Procedure* p = malloc(sizeof(Procedure));
+    *p = (Procedure){.params = malloc(args_len * sizeof(*p->params)),
+                     .func = func_ptr};
 
-    buf_ptr += sprintf(buf_ptr, "(builtin (");
     for (size_t i = 0; i < args_len; i++) {
-        buf_ptr += sprintf(buf_ptr, "%s", args[i]);
+        if (!strcmp(args[i], "&rest")) {
+            assert(i + 2 == args_len);
+            p->params[p->required] = intern(args[++i]);
+            p->rest = true;
+        } else {
+            p->params[p->required++] = intern(args[i]);
+        }
+    }
+
+    return make_procedure(BUILTIN, p);
+}
+
+// Compiles the `((params...) body)` after `lambda` or `macro` into a CLOSURE
+// or MACRO
+Value* compile_procedure(Tag tag, const Value* rest) {
+    assert(rest->tag == CONS && rest->val.cons.cdr->tag == CONS);
 
-        if (i != args_len - 1) {
-            buf_ptr += sprintf(buf_ptr, " ");
+    const Value* names = rest->val.cons.car;
+    size_t len = 0;
+    for (const Value* n = names; n->tag == CONS; n = n->val.cons.cdr) {
+        len++;
+    }
+
+    Procedure* p = malloc(sizeof(Procedure));
+    *p = (Procedure){.params = malloc((len ? len : 1) * sizeof(*p->params)),
+                     .body = rest->val.cons.cdr->val.cons.car};
+    value_ref(p->body);
+
+    for (const Value* n = names; n->tag == CONS; n = n->val.cons.cdr) {
+        const Value* name = n->val.cons.car;
+        assert(name->tag == SYMBOL);
+
+        if (name->val.symbol == &symbol_rest) {
+            // Exactly one name follows &rest
+            n = n->val.cons.cdr;
+            assert(n->tag == CONS && value_isnil(n->val.cons.cdr));
+            assert(n->val.cons.car->tag == SYMBOL);
+
+            p->params[p->required] = n->val.cons.car->val.symbol;
+            p->rest = true;
+            break;
         }
+
+        p->params[p->required++] = name->val.symbol;
     }
-    buf_ptr += sprintf(buf_ptr, ") %p)", func_ptr);
 
-    Parser parser = (Parser){.text = buf, .len = strlen(buf)};
+    return make_procedure(tag, p);
+}
+
+// Compiles a `(lambda (params...) body)` or `(macro (params...) body)` list
+// into a CLOSURE or MACRO, returns NULL for any other value. Lists are never
+// modified, so the result is kept on the list's head and shared by every
+// later call with the same list.
+Value* make_closure(const Value* form) {
+    if (form->tag != CONS || form->val.cons.car->tag != SYMBOL) {
+        return NULL;
+    }
 
-    return parse(&parser, e);
+    Value* head = form->val.cons.car;
+    const Symbol* kind = head->val.symbol;
+    if (kind != &symbol_lambda && kind != &symbol_macro) {
+        return NULL;
+    }
+
+    if (!head->val.closure) {
+        head->val.closure = compile_procedure(
+            kind == &symbol_lambda ? CLOSURE : MACRO, form->val.cons.cdr);
+    }
+
+    value_ref(head->val.closure);
+    return head->val.closure;
 }
 
-int main() {
+int main(int argc, char* argv[]) {
+    size_t chunk_values = VP_CHUNK_VALUES;
+    size_t heap_max = VP_MAX_BYTES;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp("--chunk-size", argv[i]) && i + 1 < argc &&
+            parse_size(argv[i + 1], &chunk_values)) {
+            i++;
+        } else if (!strcmp("--heap-max", argv[i]) && i + 1 < argc &&
+                   parse_size(argv[i + 1], &heap_max)) {
+            i++;
+        } else {
+            fprintf(stderr,
+                    "usage: %s [--chunk-size values] [--heap-max bytes]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    global_vp = valuepool_init(chunk_values, heap_max);
+    symbols_init();
+
     Env env = env_init(10, NULL);
     setup_symbols(&env);
-    env_put(&env, "+",
-            make_builtin(&env, (char*[]){"&rest", "numbers"}, 2, (void*)plus),
+    env_put(&env, intern("+"),
+            make_builtin((char*[]){"&rest", "numbers"}, 2, plus), false);
+    env_put(&env, intern("eq"), make_builtin((char*[]){"a", "b"}, 2, eq),
             false);
-    env_put(&env, "eq", make_builtin(&env, (char*[]){"a", "b"}, 2, (void*)eq),
+    env_put(&env, intern("car"), make_builtin((char*[]){"list"}, 1, car),
             false);
-    env_put(&env, "car", make_builtin(&env, (char*[]){"list"}, 1, (void*)car),
+    env_put(&env, intern("cdr"), make_builtin((char*[]){"list"}, 1, cdr),
             false);
-    env_put(&env, "cdr", make_builtin(&env, (char*[]){"list"}, 1, (void*)cdr),
+    env_put(&env, intern("cons"), make_builtin((char*[]){"a", "b"}, 2, cons),
             false);
-    env_put(&env, "cons",
-            make_builtin(&env, (char*[]){"a", "b"}, 2, (void*)cons), false);
-    env_put(&env, "eval", make_builtin(&env, (char*[]){"form"}, 1, (void*)eval),
+    env_put(&env, intern("eval"), make_builtin((char*[]){"form"}, 1, eval),
             false);
 
     // clang-format off
@@ -889,7 +1383,7 @@ int main() {
         "(define add '(lambda (a b) (+ a b)))"
         "(define apply '(lambda (func &rest args) (eval (cons func args))))"
         "(define list '(lambda (&rest args) args))"
-        "(define if '(macro (condition true-body false-body) (list 'cond (list condition true-body) (list #t false-body))))"
+        "(define unless '(macro (condition body) (list 'if condition #f body)))"
         "(add 5 6)"
         "(cond (#f 68) (nil 54) (#t 42))"
         "(define sum '(lambda (x) (if (eq 1 x) 1 (+ x (sum (+ x -1))))))"
@@ -897,7 +1391,11 @@ int main() {
         "(sum 5)"
         "(define add1 '(lambda (x) (+ 1 x)))"
         "(define map '(lambda (func l) (if (cdr l) (cons (apply func (car l)) (map func (cdr l))) (apply func (car l)))))"
+        "(define twice (lambda (x) (let ((y x)) (+ x y))))"
+        "(and (eq 8 (twice 4)) (or #f (eq 1 1)))"
         "(map 'add1 '(1 2 3))"
+        "(define call-with '(lambda (g v) (g v)))"
+        "(call-with '(lambda (x) (+ 1 x)) (unless (eq 1 2) 5))"
         ")";
     // clang-format on
     Parser parser = (Parser){.text = input, .len = strlen(input)};
@@ -912,4 +1410,5 @@ int main() {
 
     /* valuepool_print(&global_vp); */
     valuepool_deinit(&global_vp);
+    symbols_deinit();
 }
@@ -2,30 +2,83 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 struct Value;
 struct Env;
 
 typedef struct Value* (*specialform)(struct Value*, struct Env*);
+// Builtins read their arguments by name from the call frame they're given
+typedef struct Value* (*builtin)(struct Env*);
+
+// Every symbol name is interned exactly once, so two symbols are equal exactly
+// when they point at the same `Symbol`
+typedef struct Symbol {
+    const char* name;
+    size_t len;
+    uint64_t hash;
+    // Set on the symbols naming special forms, so a call checks this instead
+    // of comparing names
+    specialform special_form;
+} Symbol;
+
+// Open addressing table of every interned symbol, `cap` is a power of two
+typedef struct SymbolTable {
+    Symbol** slots;
+    size_t cap;
+    size_t len;
+} SymbolTable;
+
+void symboltable_register(SymbolTable* st, Symbol* s);
+const Symbol* intern_n(const char* name, size_t len);
+const Symbol* intern(const char* name);
+void symbols_init();
+void symbols_deinit();
 
 typedef struct Cons {
     struct Value* car;
     struct Value* cdr;
 } Cons;
 
+// What `make_builtin` makes of a C function, and `define` of a
+// `(lambda (params...) body)` or `(macro (params...) body)` list, so a call
+// doesn't have to pick the list apart again
+typedef struct Procedure {
+    // Parameter names in binding order, the name after `&rest` last
+    const Symbol** params;
+    size_t required;
+    bool rest;
+    union {
+        builtin func;
+        struct Value* body;
+    };
+} Procedure;
+
 typedef enum Tag {
     NUMBER,
     POINTER,
     SYMBOL,
     CONS,
+    BUILTIN,
+    CLOSURE,
+    MACRO,
 } Tag;
 
 typedef struct Value {
     Tag tag;
     union {
         double number;
-        char* string;
+        struct {
+            const Symbol* symbol;
+            // On the `lambda` or `macro` heading a list, the CLOSURE or MACRO
+            // `make_closure` compiled from that list, owned by the value
+            struct Value* closure;
+        };
         Cons cons;
         void* pointer;
+        // Owned by the value, for BUILTIN, CLOSURE and MACRO
+        Procedure* procedure;
+        // Only meaningful while the value sits on the pool's free list
+        struct Value* next_free;
     } val;
     int rc;
     int quoted;
@@ -47,21 +100,52 @@ Value* _cdr(Value* v, struct Env*);
 bool _symbol_eq(const Value*, const Value*);
 Value* symbol_eq(Value* v, struct Env*);
 
-typedef struct ValuePool {
+// The value heap is made of chunks that are mapped on demand. Every chunk is
+// aligned to its own (power of two) size, so the chunk owning a value can be
+// found by masking the value's address. Values never move once allocated.
+typedef struct ValueChunk {
+    struct ValueChunk* prev;
+    struct ValueChunk* next;
+
     Value* values;
     bool* used;
-    size_t in_use;
+    // Freed values are threaded through `val.next_free`, slots at or past
+    // `high_water` have never been handed out
+    Value* free_list;
     size_t cap;
+    size_t in_use;
+    size_t high_water;
+} ValueChunk;
+
+typedef struct ValuePool {
+    // Chunks with at least one free slot, and chunks that are completely full
+    ValueChunk* available;
+    ValueChunk* full;
+    // One empty chunk is kept around so a pool hovering at a chunk boundary
+    // doesn't map and unmap on every allocation
+    ValueChunk* spare;
+
+    size_t chunk_size;
+    size_t chunk_cap;
+    size_t chunks;
+    size_t max_chunks;
+
+    size_t in_use;
     size_t high_water;
 } ValuePool;
 
+#define VP_CHUNK_VALUES 4096
+#define VP_MAX_BYTES ((size_t)1 << 32)
+#define VP_MIN_CHUNK_SIZE ((size_t)1 << 16)
+
+ValuePool valuepool_init(size_t chunk_values, size_t max_bytes);
 Value* valuepool_alloc(ValuePool* vp);
 void valuepool_free(ValuePool* vp, Value* v);
-void valuepool_deinit(const ValuePool* vp);
+void valuepool_deinit(ValuePool* vp);
 void valuepool_print(const ValuePool* vp);
 
 typedef struct Env {
-    char** keys;
+    const Symbol** keys;
     Value** vals;
 
     size_t len;
@@ -72,9 +156,9 @@ typedef struct Env {
 
 Env env_init(size_t size, Env* parent);
 void env_deinit(Env* e);
-Value* env_get(const Env* e, const char* key);
-const Value* env_get_const(const Env* e, const char* key);
-void env_put(Env* e, const char* key, Value* val, bool increase_ref);
+Value* env_get(const Env* e, const Symbol* key);
+const Value* env_get_const(const Env* e, const Symbol* key);
+void env_put(Env* e, const Symbol* key, Value* val, bool increase_ref);
 
 typedef struct Parser {
     const char* text;
@@ -83,6 +167,7 @@ typedef struct Parser {
 } Parser;
 
 Value* parse(Parser* p, Env* e);
+Value* parse_atom(Parser* p);
 char parser_peek(Parser* p);
 char parser_get(Parser* p);
 void parser_skip_whitespace(Parser* p);
@@ -94,11 +179,17 @@ Value* _eval(Value* v, Env* env);
 Value* eval_define(Value* v, Env* env);
 Value* eval_progn(Value* v, Env* env);
 Value* eval_cond(Value* v, Env* env);
+Value* eval_if(Value* v, Env* env);
+Value* eval_and(Value* v, Env* env);
+Value* eval_or(Value* v, Env* env);
+Value* eval_let(Value* v, Env* env);
 
 /************/
 /* Builtins */
 /************/
-typedef Value* (*builtin)(Env*);
+Value* make_builtin(char* args[], size_t args_len, builtin func_ptr);
+Value* compile_procedure(Tag tag, const Value* rest);
+Value* make_closure(const Value* form);
 
 Value* plus(Env*);
 Value* eq(Env*);
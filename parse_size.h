@@ -0,0 +1,47 @@
+#pragma once
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Reads a plain byte/element count with an optional k, m or g suffix into
+// `out`. Anything else, including a count that doesn't fit a size_t, is
+// rejected and leaves `out` alone.
+static inline bool parse_size(const char* text, size_t* out) {
+    if (!isdigit((unsigned char)*text)) {
+        return false;
+    }
+
+    char* end = NULL;
+    errno = 0;
+    unsigned long long n = strtoull(text, &end, 10);
+    if (errno == ERANGE || n > SIZE_MAX) {
+        return false;
+    }
+
+    unsigned shift = 0;
+    switch (tolower((unsigned char)*end)) {
+    case 'g':
+        shift = 30;
+        end++;
+        break;
+    case 'm':
+        shift = 20;
+        end++;
+        break;
+    case 'k':
+        shift = 10;
+        end++;
+        break;
+    }
+
+    if (*end != '\0' || n > SIZE_MAX >> shift) {
+        return false;
+    }
+
+    *out = (size_t)n << shift;
+    return true;
+}